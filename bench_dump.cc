@@ -0,0 +1,173 @@
+// Benchmark driver for the `bench' target.
+//
+// Links against the sources generated by bench_gen and reports the cost
+// of dump_open and of the dump entry points as a single JSON object on
+// stdout.  Dump output itself goes to a temporary file so that it can be
+// measured without being printed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "dump.h"
+#include "bench_types.h"
+
+#ifdef __PIE__
+extern char __executable_start[1];
+#endif
+
+using namespace std;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long peak_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+// Sends stdout to a temporary file while dumping so we can count bytes.
+class Capture {
+public:
+    Capture() {
+        char tmpl[] = "/tmp/dump_bench_XXXXXX";
+        fd_ = mkstemp(tmpl);
+        if (fd_ == -1) {
+            perror("mkstemp failed");
+            exit(1);
+        }
+        unlink(tmpl);
+        fflush(stdout);
+        saved_ = dup(1);
+        dup2(fd_, 1);
+    }
+
+    long finish() {
+        fflush(stdout);
+        long size = lseek(fd_, 0, SEEK_END);
+        dup2(saved_, 1);
+        close(saved_);
+        close(fd_);
+        return size;
+    }
+
+private:
+    int fd_;
+    int saved_;
+};
+
+struct Latency {
+    double total;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+static Latency summarize(vector<double>& v) {
+    Latency l;
+    l.total = 0;
+    for (size_t i = 0; i < v.size(); i++) l.total += v[i];
+    sort(v.begin(), v.end());
+    l.p50 = v[v.size() * 50 / 100];
+    l.p90 = v[v.size() * 90 / 100];
+    l.p99 = v[v.size() * 99 / 100];
+    l.max = v.back();
+    return l;
+}
+
+static void print_latency(const char* key, const Latency& l, long bytes) {
+    printf("  \"%s\": {\"calls_total_sec\": %.6f, "
+           "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+           "\"max_us\": %.3f, \"bytes\": %ld, \"bytes_per_sec\": %.0f}",
+           key, l.total, l.p50 * 1e6, l.p90 * 1e6, l.p99 * 1e6,
+           l.max * 1e6, bytes, l.total > 0 ? bytes / l.total : 0.0);
+}
+
+int main(int argc, char* argv[]) {
+    int iters = argc > 1 ? atoi(argv[1]) : 1000;
+    if (iters < 1) iters = 1;
+
+    void* base_addr = nullptr;
+#ifdef __PIE__
+    base_addr = __executable_start;
+#endif
+
+    long rss_before = peak_rss_kb();
+    double t = now();
+    int ret = dump_open(argv[0], base_addr);
+    double open_sec = now() - t;
+    long rss_after = peak_rss_kb();
+
+    static BenchNode chain[64];
+    for (int i = 0; i < 64; i++) {
+        chain[i].next = i + 1 < 64 ? &chain[i + 1] : 0;
+        chain[i].pnext = &chain[i].next;
+        chain[i].ppnext = &chain[i].pnext;
+        chain[i].value = i;
+    }
+    static BenchDeep deep;
+    memset(&deep, 0, sizeof(deep));
+    deep.e = BENCH_E1;
+    deep.ptr = &deep.inner;
+
+    vector<double> samples(iters);
+    long bytes;
+
+    Capture c1;
+    for (int i = 0; i < iters; i++) {
+        t = now();
+        p(deep);
+        samples[i] = now() - t;
+    }
+    bytes = c1.finish();
+    Latency deep_l = summarize(samples);
+    long deep_bytes = bytes;
+
+    Capture c2;
+    for (int i = 0; i < iters; i++) {
+        BenchNode* node = &chain[i % 64];
+        t = now();
+        p(node);
+        samples[i] = now() - t;
+    }
+    bytes = c2.finish();
+    Latency chain_l = summarize(samples);
+    long chain_bytes = bytes;
+
+    Capture c3;
+    for (int i = 0; i < iters; i++) {
+        t = now();
+        dump(&chain[0], "BenchNode");
+        samples[i] = now() - t;
+    }
+    bytes = c3.finish();
+    Latency byname_l = summarize(samples);
+    long byname_bytes = bytes;
+
+    printf("{\n");
+    printf("  \"dump_open_ret\": %d,\n", ret);
+    printf("  \"dump_open_sec\": %.6f,\n", open_sec);
+    printf("  \"rss_before_open_kb\": %ld,\n", rss_before);
+    printf("  \"peak_rss_kb\": %ld,\n", rss_after);
+    printf("  \"iterations\": %d,\n", iters);
+    print_latency("dump_s_deep", deep_l, deep_bytes);
+    printf(",\n");
+    print_latency("dump_s_chain", chain_l, chain_bytes);
+    printf(",\n");
+    print_latency("dump_by_name", byname_l, byname_bytes);
+    printf("\n}\n");
+    return 0;
+}
@@ -0,0 +1,115 @@
+// Generates a synthetic program for the `bench' target.
+//
+// usage: bench_gen <dir> <num_cus> <depth> <num_enums>
+//
+// Writes <dir>/bench_types.h, which every CU includes, and
+// <dir>/cu_N.cc for each CU so that the debug info has as many copies of
+// the shared types as a real project with a large common header.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <string>
+
+using namespace std;
+
+static FILE* open_out(const string& path) {
+    FILE* fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "ERROR:  can't open %s\n", path.c_str());
+        exit(1);
+    }
+    return fp;
+}
+
+static void gen_header(const string& dir, int depth, int num_enums) {
+    FILE* fp = open_out(dir + "/bench_types.h");
+    fprintf(fp, "#ifndef bench_types_h_\n#define bench_types_h_\n\n");
+
+    fprintf(fp, "enum BenchEnum {\n");
+    for (int i = 0; i < num_enums; i++) {
+        fprintf(fp, "    BENCH_E%d,\n", i);
+    }
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp, "struct BenchNode {\n"
+                "    struct BenchNode* next;\n"
+                "    struct BenchNode** pnext;\n"
+                "    struct BenchNode*** ppnext;\n"
+                "    int value;\n"
+                "};\n\n");
+
+    fprintf(fp, "struct BenchLevel0 {\n"
+                "    int i;\n"
+                "    long l;\n"
+                "    char name[16];\n"
+                "    const char* str;\n"
+                "    BenchEnum e;\n"
+                "    BenchNode* node;\n"
+                "};\n\n");
+    for (int d = 1; d <= depth; d++) {
+        fprintf(fp, "struct BenchLevel%d {\n"
+                    "    BenchLevel%d inner;\n"
+                    "    BenchLevel%d* ptr;\n"
+                    "    short s;\n"
+                    "    unsigned long long u;\n"
+                    "    BenchEnum e;\n"
+                    "    int array[8];\n"
+                    "};\n\n", d, d-1, d-1);
+    }
+    fprintf(fp, "typedef BenchLevel%d BenchDeep;\n\n", depth);
+
+    fprintf(fp, "#endif // ! bench_types_h_\n");
+    fclose(fp);
+}
+
+static void gen_cu(const string& dir, int n, int depth) {
+    char buf[64];
+    sprintf(buf, "/cu_%d.cc", n);
+    FILE* fp = open_out(dir + buf);
+    int level = n % (depth + 1);
+    fprintf(fp, "#include \"bench_types.h\"\n\n");
+    fprintf(fp, "struct BenchCu%d {\n"
+                "    BenchLevel%d level;\n"
+                "    BenchNode node;\n"
+                "    BenchEnum e;\n"
+                "};\n\n", n, level);
+    fprintf(fp, "BenchCu%d bench_cu_%d_var;\n"
+                "BenchDeep bench_cu_%d_deep;\n\n", n, n, n);
+    fprintf(fp, "int bench_cu_%d(int arg) {\n"
+                "    BenchCu%d local = bench_cu_%d_var;\n"
+                "    return local.e + arg;\n"
+                "}\n", n, n, n);
+    fclose(fp);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 5) {
+        fprintf(stderr, "usage: %s <dir> <num_cus> <depth> <num_enums>\n",
+                argv[0]);
+        return 1;
+    }
+    string dir = argv[1];
+    int num_cus = atoi(argv[2]);
+    int depth = atoi(argv[3]);
+    int num_enums = atoi(argv[4]);
+    if (num_cus < 0 || depth < 0 || num_enums < 1) {
+        fprintf(stderr, "ERROR:  invalid parameters\n");
+        return 1;
+    }
+
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+        fprintf(stderr, "ERROR:  can't create %s\n", dir.c_str());
+        return 1;
+    }
+
+    gen_header(dir, depth, num_enums);
+    for (int i = 0; i < num_cus; i++) {
+        gen_cu(dir, i, depth);
+    }
+    return 0;
+}
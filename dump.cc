@@ -6,18 +6,50 @@
 #define HAVE_ELF64_GETEHDR
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <stdint.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fnmatch.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include <vector>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <deque>
+
+#include <cxxabi.h>
+#if defined(__has_include)
+# if __has_include(<charconv>) && __cplusplus >= 201703L
+#  include <charconv>
+# endif
+#endif
 
 using namespace std;
 
@@ -25,10 +57,27 @@ static Dwarf_Debug dbg;
 static string processing_cu;
 static map<string, class DumpUnit*> types;
 static map<int, class DumpUnit*> id2unit;
+// A location expression which is valid for pcs in [low, high).
+struct location {
+    Dwarf_Addr low;
+    Dwarf_Addr high;
+    vector<Dwarf_Loc> ops;
+};
+struct local {
+    string name;
+    int type;
+    bool param;
+    // The enclosing lexical block, or null for the whole function.
+    void* low;
+    void* high;
+    vector<location> loc;
+};
 struct func {
     string name;
     void* low;
     void* high;
+    vector<location> frame_base;
+    vector<local> locals;
 };
 static vector<func> funcs;
 struct variable {
@@ -38,10 +87,391 @@ struct variable {
     int type;
 };
 static map<string, vector<variable> > variables;
-static set<void*> disp_ptrs;
+// Variables at fixed addresses, for dump_serve.  The first definition of
+// a name wins.
+struct global {
+    void* addr;
+    int type;
+};
+static map<string, global> globals;
+// Virtual tables from ELF symbols.  `addr' is what objects' vptrs hold.
+struct vtable {
+    string name;
+    void* addr;
+};
+static vector<vtable> vtables;
+// From vptr values to the id of the most derived class, see
+// build_vtable_index.
+static unordered_map<void*, int> vtable_index;
+// Structs already shown in the current dump, so that cycles are cut.
+// Chunks of dump_parallel also record what they added and what they
+// looked for in vain, to check their guesses against earlier chunks.
+struct ShownPtrs {
+    ShownPtrs() : record(false) {}
+
+    void clear() {
+        shown.clear();
+        inserted.clear();
+        missed.clear();
+    }
+    void insert(void* p) {
+        if (shown.insert(p).second && record) inserted.push_back(p);
+    }
+    bool seen(void* p) {
+        if (shown.count(p)) return true;
+        if (record) missed.push_back(p);
+        return false;
+    }
+
+    set<void*> shown;
+    bool record;
+    vector<void*> inserted;
+    vector<void*> missed;
+};
+static thread_local ShownPtrs disp_ptrs;
+// Indentation of struct members.
+static thread_local int nest_level;
 static char** srcfiles;
 static Dwarf_Signed srcnum;
 Dwarf_Addr base_addr;
+// Strings are cut after this many bytes, see dump_set_string_limit.
+// Read without a lock by dumps on any thread.
+static atomic<size_t> string_limit(50);
+// Where variables and parameters read by open_info belong.
+static Dwarf_Addr processing_cu_low;
+static int processing_func = -1;
+static void* processing_scope_low;
+static void* processing_scope_high;
+
+// DIE offsets are per section, so ids of DIEs in .debug_types are moved
+// up by TYPES_ID_BASE.  A reference through a type signature gets an id
+// above SIG_ID_BASE when first seen, and that id is bound to the type DIE
+// once all units are read.
+static const int TYPES_ID_BASE = 0x40000000;
+static const int SIG_ID_BASE = 0x60000000;
+static int id_base;
+static map<string, int> sig_ids;
+static map<string, int> sig_types;
+// From signature ids to the id of the type DIE.
+static map<int, int> sig_alias;
+
+// With split DWARF, the executable only has a skeleton per CU and the DIEs
+// are in a .dwo file per CU or in a .dwp package.  A CU is read when one
+// of its variables, functions or types is first looked up.  Its ids are
+// above the executable's .debug_info and below TYPES_ID_BASE.
+struct SplitUnit {
+    string name;
+    string dwo_path;
+    Dwarf_Sig8 dwo_id;
+    // Not relocated, like processing_cu_low.
+    Dwarf_Addr low;
+    Dwarf_Addr high;
+    int version;
+    vector<string> srcfiles;
+    bool loaded;
+};
+struct SplitFile {
+    int fd;
+    Elf* elf;
+    Dwarf_Debug dbg;
+    int info_base;
+    int types_base;
+};
+static vector<SplitUnit> split_units;
+// Split units not read yet.  Dropped only after a unit is fully read.
+static atomic<int> splits_pending;
+static SplitFile* dwp_file;
+static bool dwp_types_loaded;
+static Dwarf_Debug main_dbg;
+static int next_split_base;
+static const SplitUnit* loading_split;
+// DWARF 5 numbers files from 0.
+static int processing_cu_version;
+
+// With a memory budget, units are kept in one group per CU.  Groups are
+// evicted least recently used first and read again from DWARF when one of
+// their ids is looked up.  Groups with handles given out are pinned.
+struct UnitGroup {
+    // Ids in [start, end) belong to this group.
+    int start;
+    int end;
+    Dwarf_Off cu_die;
+    Dwarf_Bool is_info;
+    vector<int> ids;
+    size_t bytes;
+    unsigned long long last_use;
+    bool resident;
+    bool pinned;
+};
+static vector<UnitGroup> groups;
+static int loading_group = -1;
+static size_t memory_budget;
+static size_t resident_bytes;
+static unsigned long long use_clock;
+static map<string, int> evicted_types;
+static bool opened;
+
+// With a memory budget, or while split units are left to read, even a
+// lookup may change the registry, so API calls which use it hold this for
+// their whole run.  Otherwise the registry does not change after
+// dump_open and is read without it.
+// Calls nested in a locked call, and the child of dump_snapshot, do not
+// lock again.
+static mutex registry_mu;
+static thread_local int registry_depth;
+
+class RegistryLock {
+public:
+    RegistryLock()
+        : locked_(!registry_depth &&
+                  (memory_budget ||
+                   splits_pending.load(memory_order_acquire))) {
+        if (locked_) registry_mu.lock();
+        registry_depth++;
+    }
+    ~RegistryLock() {
+        registry_depth--;
+        if (locked_) registry_mu.unlock();
+    }
+private:
+    bool locked_;
+};
+
+// Counters filled while dump_open runs.  Runtime counters are below.
+static dump_stats_t load_stats;
+
+// Only the owning thread writes a counter, so a relaxed load and store is
+// enough and costs the same as a plain increment.
+class Counter {
+public:
+    Counter() : v_(0) {}
+    void add(unsigned long long n) {
+        v_.store(v_.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+    unsigned long long get() const { return v_.load(memory_order_relaxed); }
+private:
+    atomic<unsigned long long> v_;
+};
+
+typedef map<pair<string, int>, unsigned long long> SiteCounts;
+
+// A slot of the per-thread site table.  The owning thread stores `file'
+// last, so a report on another thread never sees a half-written slot.
+struct SiteSlot {
+    SiteSlot() : file(0), line(0) {}
+    atomic<const char*> file;
+    int line;
+    Counter count;
+};
+
+struct ThreadStats {
+    ThreadStats();
+    ~ThreadStats();
+
+    // Keyed by the __FILE__ pointer, which is stable for a call site.
+    // Only growing the table takes sites_mu.
+    void addSite(const char* file, int line) {
+        size_t mask = sites.size() - 1;
+        size_t i = siteHash(file, line) & mask;
+        for (;; i = (i + 1) & mask) {
+            SiteSlot& s = sites[i];
+            const char* f = s.file.load(memory_order_relaxed);
+            if (!f) break;
+            if (f == file && s.line == line) {
+                s.count.add(1);
+                return;
+            }
+        }
+        if ((sites_used + 1) * 2 > sites.size()) {
+            growSites();
+            addSite(file, line);
+            return;
+        }
+        sites_used++;
+        sites[i].line = line;
+        sites[i].count.add(1);
+        sites[i].file.store(file, memory_order_release);
+    }
+
+    Counter dump_calls;
+    Counter dump_s_calls;
+    Counter lookup_misses;
+    Counter unreadable_ptrs;
+    Counter bytes_emitted;
+    Counter registry_hits;
+    Counter registry_loads;
+    Counter registry_evictions;
+    mutex sites_mu;
+    vector<SiteSlot> sites;
+    size_t sites_used;
+
+private:
+    static size_t siteHash(const char* file, int line) {
+        return ((uintptr_t)file >> 3) * 31 + line;
+    }
+
+    void growSites() {
+        vector<SiteSlot> grown(sites.size() * 2);
+        size_t mask = grown.size() - 1;
+        for (size_t i = 0; i < sites.size(); i++) {
+            const char* f = sites[i].file.load(memory_order_relaxed);
+            if (!f) continue;
+            size_t j = siteHash(f, sites[i].line) & mask;
+            while (grown[j].file.load(memory_order_relaxed))
+                j = (j + 1) & mask;
+            grown[j].line = sites[i].line;
+            grown[j].count.add(sites[i].count.get());
+            grown[j].file.store(f, memory_order_relaxed);
+        }
+        lock_guard<mutex> lock(sites_mu);
+        sites.swap(grown);
+    }
+};
+
+static mutex stats_mu;
+static set<ThreadStats*> live_stats;
+// Counters of threads which already exited.
+static dump_stats_t retired_stats;
+static SiteCounts retired_sites;
+
+static void add_thread_stats(const ThreadStats* ts, dump_stats_t* st,
+                             SiteCounts* sites)
+{
+    if (st) {
+        st->dump_calls += ts->dump_calls.get();
+        st->dump_s_calls += ts->dump_s_calls.get();
+        st->lookup_misses += ts->lookup_misses.get();
+        st->unreadable_ptrs += ts->unreadable_ptrs.get();
+        st->bytes_emitted += ts->bytes_emitted.get();
+        st->registry_hits += ts->registry_hits.get();
+        st->registry_loads += ts->registry_loads.get();
+        st->registry_evictions += ts->registry_evictions.get();
+    }
+    if (sites) {
+        for (size_t i = 0; i < ts->sites.size(); i++) {
+            const SiteSlot& s = ts->sites[i];
+            const char* f = s.file.load(memory_order_acquire);
+            if (f) (*sites)[make_pair(string(f), s.line)] += s.count.get();
+        }
+    }
+}
+
+ThreadStats::ThreadStats() : sites(64), sites_used(0) {
+    lock_guard<mutex> lock(stats_mu);
+    live_stats.insert(this);
+}
+
+ThreadStats::~ThreadStats() {
+    lock_guard<mutex> lock(stats_mu);
+    live_stats.erase(this);
+    lock_guard<mutex> sites_lock(sites_mu);
+    add_thread_stats(this, &retired_stats, &retired_sites);
+}
+
+static ThreadStats& tstats() {
+    static thread_local ThreadStats ts;
+    return ts;
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Workers of dump_parallel format into this instead of stdout.
+static thread_local string* emit_buf;
+
+// The endpoint of dump_serve and the child of dump_snapshot stream the
+// buffer to a file descriptor.  dump_serve also stops a query by throwing
+// EmitLimit when it gets too long or too slow.
+struct EmitStream {
+    int fd;
+    size_t sent;
+    size_t max_bytes;
+    double deadline;
+    unsigned calls;
+};
+struct EmitLimit {};
+static thread_local EmitStream* emit_stream;
+static const size_t EMIT_CHUNK = 4096;
+
+static bool send_all(int fd, const char* p, size_t n) {
+    while (n) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        // Snapshots may go to files and pipes.
+        if (r < 0 && errno == ENOTSOCK) r = write(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static void flush_stream() {
+    EmitStream* s = emit_stream;
+    size_t n = emit_buf->size();
+    bool ok = send_all(s->fd, emit_buf->data(), n);
+    emit_buf->clear();
+    if (!ok) throw EmitLimit();
+    s->sent += n;
+    tstats().bytes_emitted.add(n);
+}
+
+static void check_stream() {
+    EmitStream* s = emit_stream;
+    if (s->sent + emit_buf->size() > s->max_bytes) throw EmitLimit();
+    if (++s->calls % 64 == 0 && now_sec() > s->deadline) throw EmitLimit();
+    if (emit_buf->size() >= EMIT_CHUNK) flush_stream();
+}
+
+// All dump output goes through here.
+static int vemit(const char* fmt, va_list ap) {
+    int n;
+    if (emit_buf) {
+        char buf[256];
+        va_list aq;
+        va_copy(aq, ap);
+        n = vsnprintf(buf, sizeof(buf), fmt, aq);
+        va_end(aq);
+        if (n < (int)sizeof(buf)) {
+            emit_buf->append(buf, n);
+        }
+        else {
+            size_t len = emit_buf->size();
+            emit_buf->resize(len + n + 1);
+            vsnprintf(&(*emit_buf)[len], n + 1, fmt, ap);
+            emit_buf->resize(len + n);
+        }
+        // Counted when the buffer is written out.
+        if (emit_stream) check_stream();
+        return n;
+    }
+    n = vprintf(fmt, ap);
+    if (n > 0) tstats().bytes_emitted.add(n);
+    return n;
+}
+
+static int emit(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+static int emit(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vemit(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+// For text which is already formatted.
+static void emit_raw(const char* s, size_t n) {
+    if (emit_buf) {
+        emit_buf->append(s, n);
+        if (emit_stream) check_stream();
+        return;
+    }
+    fwrite(s, 1, n, stdout);
+    tstats().bytes_emitted.add(n);
+}
 
 static void print_error(const char* msg, int dwarf_code, Dwarf_Error err) {
     if (dwarf_code == DW_DLV_ERROR) {
@@ -70,32 +500,367 @@ static bool is_readable(void *ptr) {
     return readable;
 }
 
+// Probes the first byte and, if it is on another page, the last one.
+static bool is_readable_range(void* p, int len) {
+    if (!p || !is_readable(p)) return false;
+    char* last = (char*)p + max(len, 1) - 1;
+    if ((uintptr_t)p / 4096 == (uintptr_t)last / 4096) return true;
+    return is_readable(last);
+}
+
+// Like is_readable, but async-signal-safe: no stdio, no exit, and a
+// failed pipe(2) counts as unreadable.
+static bool probe_readable(const void* ptr) {
+    int fd[2];
+    if (pipe(fd)) return false;
+    bool readable = (write(fd[1], ptr, 1) == 1);
+    close(fd[0]);
+    close(fd[1]);
+    return readable;
+}
+
+// Copies up to `len' bytes, stopping at the first unreadable page, and
+// returns the number of bytes copied.  Async-signal-safe.
+static size_t read_bounded(void* dst, const void* src, size_t len) {
+    static const size_t PAGE = 4096;
+    static const int IOVS = 64;
+    int saved_errno = errno;
+    size_t done = 0;
+    while (done < len) {
+        // A fault anywhere in an iovec fails all of it, so split by page.
+        struct iovec remote[IOVS];
+        int n = 0;
+        uintptr_t addr = (uintptr_t)src + done;
+        size_t batch = 0;
+        while (n < IOVS && done + batch < len) {
+            size_t chunk = min(len - done - batch,
+                               PAGE - (addr + batch) % PAGE);
+            remote[n].iov_base = (void*)(addr + batch);
+            remote[n].iov_len = chunk;
+            batch += chunk;
+            n++;
+        }
+        struct iovec local = { (char*)dst + done, batch };
+        ssize_t r = process_vm_readv(getpid(), &local, 1, remote, n, 0);
+        if (r < 0 && (errno == ENOSYS || errno == EPERM)) {
+            // No process_vm_readv here; probe page by page.
+            size_t before = done;
+            for (int i = 0; i < n && probe_readable(remote[i].iov_base);
+                 i++)
+            {
+                memcpy((char*)dst + done, remote[i].iov_base,
+                       remote[i].iov_len);
+                done += remote[i].iov_len;
+            }
+            if (done - before < batch) break;
+            continue;
+        }
+        if (r <= 0) break;
+        done += r;
+        if ((size_t)r < batch) break;
+    }
+    errno = saved_errno;
+    return done;
+}
+
+// Copies of memory which a dump reads instead of the memory itself, by
+// original address.  Pointers are followed into these copies.
+// dump_log_decode fills one from a record.  A live image copies more with
+// read_bounded as pointers reach it, so that dump_serve never touches an
+// object which another thread may free or unmap meanwhile.
+class MemImage {
+public:
+    struct Block {
+        uintptr_t addr;
+        size_t len;
+        char* copy;
+    };
+    vector<Block> blocks;
+    bool live;
+
+    MemImage() : live(false) {}
+    ~MemImage() {
+        for (size_t i = 0; i < owned_.size(); i++) delete[] owned_[i];
+    }
+
+    void add(const Block& b) {
+        map<uintptr_t, size_t>::iterator ite = by_addr_.find(b.addr);
+        if (ite == by_addr_.end()) by_addr_[b.addr] = blocks.size();
+        else if (blocks[ite->second].len < b.len) ite->second = blocks.size();
+        by_copy_[b.copy] = blocks.size();
+        blocks.push_back(b);
+    }
+
+    // A copy of `len' bytes at `p', or 0.
+    void* find(void* p, size_t len) {
+        uintptr_t a = (uintptr_t)p;
+        map<uintptr_t, size_t>::const_iterator ite = by_addr_.upper_bound(a);
+        if (ite != by_addr_.begin()) {
+            const Block& b = blocks[(--ite)->second];
+            if (a - b.addr + len <= b.len) return b.copy + (a - b.addr);
+        }
+        if (!live) {
+            // Pointees of a record may overlap.
+            for (size_t i = 0; i < blocks.size(); i++) {
+                const Block& b = blocks[i];
+                if (a >= b.addr && a - b.addr + len <= b.len) {
+                    return b.copy + (a - b.addr);
+                }
+            }
+            return 0;
+        }
+        char* copy = new char[len];
+        if (read_bounded(copy, p, len) != len) {
+            delete[] copy;
+            return 0;
+        }
+        owned_.push_back(copy);
+        Block b = { a, len, copy };
+        add(b);
+        return copy;
+    }
+
+    // The original address of a copy.
+    const void* original(const void* copy) const {
+        const char* c = (const char*)copy;
+        map<const char*, size_t>::const_iterator ite =
+            by_copy_.upper_bound(c);
+        if (ite != by_copy_.begin()) {
+            const Block& b = blocks[(--ite)->second];
+            if (c < b.copy + b.len) {
+                return (const void*)(b.addr + (c - b.copy));
+            }
+        }
+        return copy;
+    }
+
+private:
+    MemImage(const MemImage&);
+    void operator=(const MemImage&);
+
+    vector<char*> owned_;
+    map<uintptr_t, size_t> by_addr_;
+    map<const char*, size_t> by_copy_;
+};
+static thread_local MemImage* mem_image;
+
+// Makes dumps of this thread read through `image' while it lives.
+class ImageScope {
+public:
+    explicit ImageScope(MemImage* image) : saved_(mem_image) {
+        mem_image = image;
+    }
+    ~ImageScope() {
+        mem_image = saved_;
+    }
+private:
+    MemImage* saved_;
+};
+
 struct DwarfException {};
 
+// The offset of a member which depends on the object, such as a virtual
+// base, see DumpStruct::Member.
+static const int LOC_EXPR = -2;
+
+// Rough per-node overhead of std::map, for memory estimates.
+static const size_t MAP_NODE_SIZE = 32;
+
+static size_t heap_size(const string& s) {
+    // Short strings live inside the object.
+    return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
 namespace {
-    static void print_escaped(const char* s, int n) {
-        for (int i = 0; i < n; i++, s++) {
-            if (isprint(*s)) printf("%c", *s);
-            else printf("\\x%02x", (unsigned char)*s);
+    static const char DIGITS2[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+
+    // These write backwards from `end' and return the first character.
+    static char* format_dec(unsigned long long v, char* end) {
+        while (v >= 100) {
+            end -= 2;
+            memcpy(end, DIGITS2 + v % 100 * 2, 2);
+            v /= 100;
         }
+        if (v >= 10) {
+            end -= 2;
+            memcpy(end, DIGITS2 + v * 2, 2);
+        }
+        else {
+            *--end = '0' + v;
+        }
+        return end;
     }
 
-    static void dump_str(char* str, int size = -1) {
-        if (size == -1) size = strlen(str);
-        if (size < 50) {
-            printf("\"");
-            print_escaped(str, size);
-            printf("\" [%p]", str);
+#ifdef __SIZEOF_INT128__
+    static char* format_dec128(unsigned __int128 v, char* end) {
+        static const unsigned long long E19 = 10000000000000000000ULL;
+        // Nineteen digits at a time with 64-bit division.
+        while (v >= E19) {
+            char* start = format_dec(v % E19, end);
+            while (start > end - 19) *--start = '0';
+            end = start;
+            v /= E19;
         }
-        else {
-            static const int BUFSIZE = 50;
-            char buf[BUFSIZE];
-            strncpy(buf, str, BUFSIZE);
-            buf[BUFSIZE-1] = '\0';
-            printf("\"");
-            print_escaped(buf, BUFSIZE);
-            printf("...\" [%p]", str);
+        return format_dec(v, end);
+    }
+#endif
+
+    static char* format_hex(unsigned long long v, int digits, char* end) {
+        for (int i = 0; i < digits; i++) {
+            *--end = HEX_DIGITS[v & 15];
+            v >>= 4;
+        }
+        return end;
+    }
+
+    // Shortest text which reads back as the same value, always with '.'
+    // as the decimal point.
+    template <class T>
+    static int format_float(T v, char* buf, int size) {
+#ifdef __cpp_lib_to_chars
+        return std::to_chars(buf, buf + size, v).ptr - buf;
+#else
+        int n = 0;
+        for (int prec = 1; prec <= 21; prec++) {
+            n = snprintf(buf, size, "%.*Lg", prec, (long double)v);
+            if ((T)strtold(buf, 0) == v) break;
+        }
+        // Undo the locale.
+        for (int i = 0; i < n; i++) {
+            if (buf[i] == ',') buf[i] = '.';
         }
+        return n;
+#endif
+    }
+
+    // Length of the leading run of printable ASCII.
+    static size_t printable_run(const char* s, size_t n) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i space = _mm256_set1_epi8(0x1f);
+        const __m256i del = _mm256_set1_epi8(0x7f);
+        for (; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+            // Signed, so bytes from 0x80 are below 0x1f too.
+            __m256i ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, del),
+                                             _mm256_cmpgt_epi8(v, space));
+            unsigned bad = ~(unsigned)_mm256_movemask_epi8(ok);
+            if (bad) return i + __builtin_ctz(bad);
+        }
+#elif defined(__SSE2__)
+        const __m128i space = _mm_set1_epi8(0x1f);
+        const __m128i del = _mm_set1_epi8(0x7f);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+            __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del),
+                                          _mm_cmpgt_epi8(v, space));
+            unsigned bad = ~(unsigned)_mm_movemask_epi8(ok) & 0xffff;
+            if (bad) return i + __builtin_ctz(bad);
+        }
+#endif
+        for (; i < n; i++) {
+            unsigned char c = s[i];
+            if (c < 0x20 || c > 0x7e) break;
+        }
+        return i;
+    }
+
+    // Position of the first NUL, or n.
+    static size_t find_nul(const char* s, size_t n) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i zero = _mm256_setzero_si256();
+        for (; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+            unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+            if (m) return i + __builtin_ctz(m);
+        }
+#elif defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+            unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+            if (m) return i + __builtin_ctz(m);
+        }
+#endif
+        for (; i < n && s[i]; i++) {}
+        return i;
+    }
+
+    // Length of a well-formed UTF-8 sequence at `s', or 0.
+    static size_t utf8_len(const unsigned char* s, size_t n) {
+        size_t len;
+        if (s[0] >= 0xc2 && s[0] <= 0xdf) len = 2;
+        else if (s[0] >= 0xe0 && s[0] <= 0xef) len = 3;
+        else if (s[0] >= 0xf0 && s[0] <= 0xf4) len = 4;
+        else return 0;
+        if (n < len) return 0;
+        for (size_t i = 1; i < len; i++) {
+            if ((s[i] & 0xc0) != 0x80) return 0;
+        }
+        // Overlong forms, surrogates and code points above U+10FFFF.
+        if (s[0] == 0xe0 && s[1] < 0xa0) return 0;
+        if (s[0] == 0xed && s[1] >= 0xa0) return 0;
+        if (s[0] == 0xf0 && s[1] < 0x90) return 0;
+        if (s[0] == 0xf4 && s[1] >= 0x90) return 0;
+        return len;
+    }
+
+    // Printable runs and valid UTF-8 are copied as is, other bytes
+    // become \xNN.
+    static void print_escaped(const char* s, size_t n) {
+        static thread_local string out;
+        out.clear();
+        size_t i = 0;
+        while (i < n) {
+            size_t run = printable_run(s + i, n - i);
+            out.append(s + i, run);
+            i += run;
+            if (i == n) break;
+            size_t u = utf8_len((const unsigned char*)s + i, n - i);
+            if (u) {
+                out.append(s + i, u);
+                i += u;
+                continue;
+            }
+            unsigned char c = s[i++];
+            char esc[4] = { '\\', 'x', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 15] };
+            out.append(esc, 4);
+        }
+        emit_raw(out.data(), out.size());
+    }
+
+    // A C string if `size' is negative, otherwise a char array which
+    // may lack the terminator.  Reads stop at unreadable memory.  `addr'
+    // is shown instead of `str' if it is a copy.
+    static void dump_str(char* str, int size = -1, const void* addr = 0) {
+        static thread_local string buf;
+        size_t limit = string_limit.load(memory_order_relaxed);
+        size_t n = size < 0 ? limit + 1 : min((size_t)size, limit + 1);
+        if (!addr) addr = mem_image ? mem_image->original(str) : str;
+        buf.resize(n);
+        size_t r = read_bounded(&buf[0], str, n);
+        if (!r && n) {
+            tstats().unreadable_ptrs.add(1);
+            emit("%p <invalid ptr>", addr);
+            return;
+        }
+        size_t len = find_nul(buf.data(), r);
+        bool whole = len < r || (size >= 0 && r == (size_t)size);
+        emit_raw("\"", 1);
+        print_escaped(buf.data(), min(len, limit));
+        emit("%s\" [%p]", whole ? "" : "...", addr);
     }
 
     static Dwarf_Half getTag(Dwarf_Die die) {
@@ -159,7 +924,7 @@ namespace {
         enum Dwarf_Form_Class cls;
         ret = dwarf_highpc_b(die, &pc, &form, &cls, &err);
         if (ret == DW_DLV_NO_ENTRY) return 0;
-        if (form == DW_FORM_CLASS_CONSTANT) {
+        if (cls == DW_FORM_CLASS_CONSTANT) {
             pc += low_pc;
         }
         if (ret != DW_DLV_OK) {
@@ -182,6 +947,20 @@ namespace {
         return pc;
     }
 
+    // Empty if the attribute is missing.
+    static string getAttrStr(Dwarf_Die die, Dwarf_Half an, const char* ans) {
+        Dwarf_Attribute attr;
+        Dwarf_Error err;
+        char* str;
+        if (getAttr(die, an, ans, &attr)) return "";
+        int ret = dwarf_formstring(attr, &str, &err);
+        if (ret != DW_DLV_OK) {
+            print_error("dwarf_formstring", ret, err);
+            throw DwarfException();
+        }
+        return str;
+    }
+
     static string getName(Dwarf_Die die) {
         int ret;
         Dwarf_Error err;
@@ -205,24 +984,23 @@ namespace {
         return string(str);
     }
 
+    static int getSigId(const Dwarf_Sig8& sig8) {
+        string sig(sig8.signature, sizeof(sig8.signature));
+        map<string, int>::iterator ite = sig_ids.find(sig);
+        if (ite != sig_ids.end()) return ite->second;
+        int id = SIG_ID_BASE + sig_ids.size();
+        sig_ids[sig] = id;
+        return id;
+    }
+
     static int getType(Dwarf_Die die,
                        Dwarf_Half an = DW_AT_type, string ans = "type")
     {
         int ret;
         Dwarf_Error err;
         Dwarf_Attribute attr;
-        Dwarf_Off id, aoff, off;
-
-        ret = dwarf_dieoffset(die, &aoff, &err);
-        if (ret != DW_DLV_OK) {
-            print_error("dwarf_dieoffset", ret, err);
-            throw DwarfException();
-        }
-        ret = dwarf_die_CU_offset(die, &off, &err);
-        if (ret != DW_DLV_OK) {
-            print_error("dwarf_die_CU_offset", ret, err);
-            throw DwarfException();
-        }
+        Dwarf_Off id;
+        Dwarf_Half form;
 
         ret = dwarf_attr(die, an, &attr, &err);
         if (ret == DW_DLV_NO_ENTRY) {
@@ -232,16 +1010,31 @@ namespace {
             print_error(("dwarf_attr " + ans).c_str(), ret, err);
             throw DwarfException();
         }
-        ret = dwarf_formref(attr, &id, &err);
+
+        ret = dwarf_whatform(attr, &form, &err);
+        if (ret == DW_DLV_OK && form == DW_FORM_ref_sig8) {
+            Dwarf_Sig8 sig;
+            ret = dwarf_formsig8(attr, &sig, &err);
+            if (ret != DW_DLV_OK) {
+                print_error("dwarf_formsig8", ret, err);
+                throw DwarfException();
+            }
+            return getSigId(sig);
+        }
+
+        ret = dwarf_global_formref(attr, &id, &err);
         if (ret != DW_DLV_OK) {
-            print_error("dwarf_formref", ret, err);
+            print_error("dwarf_global_formref", ret, err);
             throw DwarfException();
         }
 
-        return aoff-off+id;
+        return id + id_base;
     }
 
-    static int getLoc(Dwarf_Die die) {
+    // Returns DW_AT_data_member_location, or -1 if there is none.  A
+    // location which is not a constant offset, such as that of a virtual
+    // base, is returned in `ops' with LOC_EXPR.
+    static int getLoc(Dwarf_Die die, vector<Dwarf_Loc>* ops) {
         int ret;
         Dwarf_Error err;
         Dwarf_Attribute attr;
@@ -269,81 +1062,599 @@ namespace {
             throw DwarfException();
         }
 
-        return loc[0]->ld_s[0].lr_number;
+        int off = LOC_EXPR;
+        Dwarf_Locdesc* ld = loc[0];
+        int a = ld->ld_cents == 1 ? ld->ld_s[0].lr_atom : -1;
+        if (a == DW_OP_plus_uconst ||
+            (a >= DW_OP_const1u && a <= DW_OP_consts)) {
+            off = ld->ld_s[0].lr_number;
+        }
+        else if (a >= DW_OP_lit0 && a <= DW_OP_lit31) {
+            off = a - DW_OP_lit0;
+        }
+        else {
+            ops->assign(ld->ld_s, ld->ld_s + ld->ld_cents);
+        }
+        for (Dwarf_Signed i = 0; i < size; i++) {
+            dwarf_dealloc(dbg, loc[i]->ld_s, DW_DLA_LOC_BLOCK);
+            dwarf_dealloc(dbg, loc[i], DW_DLA_LOCDESC);
+        }
+        dwarf_dealloc(dbg, loc, DW_DLA_LIST);
+        return off;
     }
 
-}
-
-class DumpUnit {
-public:
-    virtual void dump(void* p) =0;
-    virtual string name() =0;
-    virtual ~DumpUnit() {}
-};
-
-class DumpPrim : public DumpUnit {
-public:
-    DumpPrim(Dwarf_Die die) {
-        name_ = getName(die);
-        size_ = getSize(die);
-        types[name_] = this;
-    }
+    // Reads a location expression or a location list.  Entries of a list
+    // are relative to the base address of the CU.
+    static vector<location> getLocation(Dwarf_Die die, Dwarf_Half an,
+                                        const char* ans)
+    {
+        vector<location> locs;
+        Dwarf_Attribute attr;
+        Dwarf_Locdesc** llbuf;
+        Dwarf_Signed count;
+        Dwarf_Error err;
 
-    virtual void dump(void* p) {
-        if (size_ == 1) {
-            if (name_.find("bool") == string::npos) {
-                unsigned char c = *(char*)p;
-                if (isprint(c)) printf("'%c' (%02x)", c, c);
-                else printf("'\\x%02x' (%02x)", c, c);
+        if (getAttr(die, an, ans, &attr)) return locs;
+        // Constants have no location, which is not an error.
+        if (dwarf_loclist_n(attr, &llbuf, &count, &err) != DW_DLV_OK) {
+            return locs;
+        }
+        for (Dwarf_Signed i = 0; i < count; i++) {
+            Dwarf_Locdesc* ld = llbuf[i];
+            location l;
+            if (ld->ld_from_loclist) {
+                l.low = ld->ld_lopc + processing_cu_low + base_addr;
+                l.high = ld->ld_hipc + processing_cu_low + base_addr;
             }
             else {
-                bool* bp = (bool*)p;
-                printf(*bp ? "true" : "false\n");
+                l.low = 0;
+                l.high = (Dwarf_Addr)-1;
             }
+            l.ops.assign(ld->ld_s, ld->ld_s + ld->ld_cents);
+            locs.push_back(l);
+            dwarf_dealloc(dbg, ld->ld_s, DW_DLA_LOC_BLOCK);
+            dwarf_dealloc(dbg, ld, DW_DLA_LOCDESC);
         }
-        else if (size_ == 2) {
-            short* ip = (short*)p;
-            printf("%d (0x%04x)", *ip, *ip);
-        }
-        else if (size_ == 4) {
-            int* ip = (int*)p;
-            printf("%d (0x%08x)", *ip, *ip);
-        }
-        else if (size_ == 8) {
-            long long* ip = (long long*)p;
-            printf("%lld (0x%016llx)", *ip, *ip);
-        }
-        else {
-            printf("unimplemented primitive '%s'\n", name_.c_str());
-            return;
-        }
-//        printf(" : %s\n", name_.c_str());
+        dwarf_dealloc(dbg, llbuf, DW_DLA_LIST);
+        return locs;
     }
 
-    virtual string name() { return name_; }
+}
 
-private:
-    string name_;
-    int size_;
+static string unit_key(int id);
+static DumpUnit* find_unit(int id);
+static void load_split(SplitUnit* su);
+static DumpUnit* strip_unit(DumpUnit* u);
+
+// A prebuilt index is what dump_open would read from DWARF, as flat
+// tables which refer to each other and to the string table by index.  It
+// is embedded as an ELF section by dump_index, see dump_write_index.
+static const char INDEX_MAGIC[8] = { 'D', 'U', 'M', 'P', 'I', 'D', 'X', 0 };
+static const uint32_t INDEX_VERSION = 3;
+static const char INDEX_SECTION[] = ".dumper_index";
+
+enum IndexTable {
+    IDX_UNITS,
+    IDX_IDS,
+    IDX_ALIASES,
+    IDX_TYPES,
+    IDX_MEMBERS,
+    IDX_ENUMS,
+    IDX_ARGS,
+    IDX_VARS,
+    IDX_FUNCS,
+    IDX_VTABLES,
+    IDX_EXPRS,
+    IDX_LOCALS,
+    IDX_LOCS,
+    IDX_GLOBALS,
+    IDX_STRINGS,
+    IDX_NUM
 };
 
-class DumpStruct : public DumpUnit {
-public:
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pointer_size;
+    uint64_t offsets[IDX_NUM];
+    uint64_t counts[IDX_NUM];
+};
+
+struct IndexUnit {
+    int32_t kind;
+    int32_t id;
+    int32_t tag;
+    int32_t size;
+    int32_t type;
+    uint32_t name;
+    // A range of IDX_MEMBERS, IDX_ENUMS or IDX_ARGS.
+    uint32_t first;
+    uint32_t count;
+    // Encoding, polymorphic or the number of elements.
+    int32_t extra;
+};
+
+// Ids to units, signature ids to ids, or type names to units.
+struct IndexPair {
+    int32_t key;
+    int32_t value;
+};
+
+struct IndexMember {
+    uint32_t name;
+    int32_t type;
+    int32_t loc;
+    uint8_t bits;
+    uint8_t shift;
+    uint8_t unit;
+    uint8_t pad;
+    // Operations of a LOC_EXPR member in IDX_EXPRS.
+    uint32_t expr_first;
+    uint32_t expr_count;
+};
+
+struct IndexOp {
+    uint32_t atom;
+    uint32_t pad;
+    uint64_t number;
+};
+
+struct IndexEnum {
+    int32_t value;
+    uint32_t name;
+};
+
+struct IndexVar {
+    uint32_t cu;
+    uint32_t name;
+    uint32_t file;
+    int32_t line;
+    int32_t type;
+};
+
+// Addresses are before relocation by base_addr.
+struct IndexAddr {
+    uint64_t low;
+    uint64_t high;
+    uint32_t name;
+    uint32_t pad;
+};
+
+struct IndexFunc {
+    uint64_t low;
+    uint64_t high;
+    uint32_t name;
+    // Ranges of IDX_LOCS and IDX_LOCALS.
+    uint32_t frame_first;
+    uint32_t frame_count;
+    uint32_t local_first;
+    uint32_t local_count;
+    uint32_t pad;
+};
+
+struct IndexLocal {
+    uint32_t name;
+    int32_t type;
+    uint32_t param;
+    // A range of IDX_LOCS.
+    uint32_t loc_first;
+    uint32_t loc_count;
+    uint32_t pad;
+    // The enclosing lexical block, or zeros for the whole function.
+    uint64_t low;
+    uint64_t high;
+};
+
+// Operations in IDX_EXPRS valid for pcs in [low, high), or for all of
+// them if `low' is 0 and `high' is all ones.
+struct IndexLoc {
+    uint64_t low;
+    uint64_t high;
+    uint32_t expr_first;
+    uint32_t expr_count;
+};
+
+struct IndexGlobal {
+    uint64_t addr;
+    uint32_t name;
+    int32_t type;
+};
+
+class IndexWriter {
+public:
+    uint32_t str(const string& s) {
+        map<string, uint32_t>::iterator ite = str_index.find(s);
+        if (ite != str_index.end()) return ite->second;
+        uint32_t off = strings.size();
+        strings.insert(strings.end(), s.c_str(), s.c_str() + s.size() + 1);
+        str_index[s] = off;
+        return off;
+    }
+
+    vector<IndexUnit> units;
+    vector<IndexPair> ids;
+    vector<IndexPair> aliases;
+    vector<IndexPair> types;
+    vector<IndexMember> members;
+    vector<IndexEnum> enums;
+    vector<int32_t> args;
+    vector<IndexVar> vars;
+    vector<IndexFunc> funcs;
+    vector<IndexAddr> vtables;
+    vector<IndexOp> exprs;
+    vector<IndexLocal> locals;
+    vector<IndexLoc> locs;
+    vector<IndexGlobal> globals;
+    vector<char> strings;
+
+private:
+    map<string, uint32_t> str_index;
+};
+
+class IndexReader {
+public:
+    explicit IndexReader(const char* base)
+        : base_(base), header_((const IndexHeader*)base) {}
+
+    template <class T>
+    const T* table(IndexTable t) const {
+        return (const T*)(base_ + header_->offsets[t]);
+    }
+    size_t count(IndexTable t) const {
+        return header_->counts[t];
+    }
+    const char* str(uint32_t off) const {
+        return table<char>(IDX_STRINGS) + off;
+    }
+    bool has_str(uint32_t off) const {
+        return off < count(IDX_STRINGS);
+    }
+    bool has_range(IndexTable t, uint32_t first, uint32_t num) const {
+        return first <= count(t) && num <= count(t) - first;
+    }
+
+private:
+    const char* base_;
+    const IndexHeader* header_;
+};
+
+// A native formatter, see dump_register_formatter.
+struct Formatter {
+    dump_formatter_fn fn;
+    void* arg;
+};
+
+// Keyed by type name.  Registration may come from static initializers of
+// other files, which can run before the statics of this one.
+static map<string, Formatter>& formatters() {
+    static map<string, Formatter> f;
+    return f;
+}
+
+static const Formatter* find_formatter(const string& name) {
+    map<string, Formatter>& f = formatters();
+    if (f.empty()) return 0;
+    map<string, Formatter>::const_iterator ite = f.find(name);
+    return ite != f.end() ? &ite->second : 0;
+}
+
+class DumpUnit {
+public:
+    DumpUnit() : id(0), formatter(0) {}
+
+    virtual void dump(void* p) =0;
+    virtual string name() =0;
+    // Size of an object of this type in bytes, or -1 if unknown.
+    virtual int size() =0;
+    // Approximate number of bytes this unit keeps alive.
+    virtual size_t memory() =0;
+    // Units with the same key are interchangeable, see unify_units.
+    virtual string key() =0;
+    // Fills everything but kind and id of a record of the index.
+    virtual void save(IndexWriter* w, IndexUnit* rec) =0;
+    virtual ~DumpUnit() {}
+
+    // The id of the DIE this unit was built from.
+    int id;
+    // Set for structs and typedefs when their name is registered.
+    const Formatter* formatter;
+};
+
+// How the bytes of a primitive are interpreted.
+enum PrimClass {
+    PRIM_SIGNED,
+    PRIM_UNSIGNED,
+    PRIM_FLOAT,
+    PRIM_BOOL,
+    PRIM_CHAR,
+};
+
+class DumpPrim : public DumpUnit {
+public:
+    DumpPrim(Dwarf_Die die) {
+        name_ = getName(die);
+        size_ = getSize(die);
+        encoding_ = getAttrInt(die, DW_AT_encoding, "encoding");
+        types[name_] = this;
+    }
+
+    DumpPrim(const IndexReader& r, const IndexUnit& rec) {
+        name_ = r.str(rec.name);
+        size_ = rec.size;
+        encoding_ = rec.extra;
+    }
+
+    virtual void save(IndexWriter* w, IndexUnit* rec) {
+        rec->name = w->str(name_);
+        rec->size = size_;
+        rec->extra = encoding_;
+    }
+
+    virtual void dump(void* p) {
+        // Large enough for an __int128 in decimal and hex.
+        char buf[96];
+        char* end = buf + sizeof(buf);
+        char* s = end;
+        PrimClass k = klass();
+
+        if (k == PRIM_BOOL) {
+            emit_raw(*(bool*)p ? "true" : "false", *(bool*)p ? 4 : 5);
+            return;
+        }
+        if (k == PRIM_CHAR) {
+            unsigned char c = *(char*)p;
+            *--s = ')';
+            s = format_hex(c, 2, s);
+            s -= 3;
+            memcpy(s, "' (", 3);
+            if (isprint(c)) {
+                *--s = c;
+            }
+            else {
+                s = format_hex(c, 2, s);
+                s -= 2;
+                memcpy(s, "\\x", 2);
+            }
+            *--s = '\'';
+            emit_raw(s, end - s);
+            return;
+        }
+        if (k == PRIM_FLOAT) {
+            int n = -1;
+            if (encoding_ == DW_ATE_complex_float) {
+                n = formatComplex(p, buf, sizeof(buf));
+            }
+            else {
+                n = formatFloat(p, size_, buf, sizeof(buf));
+            }
+            if (n < 0) {
+                emit("unimplemented primitive '%s'\n", name_.c_str());
+                return;
+            }
+            emit_raw(buf, n);
+            return;
+        }
+
+        unsigned long long v;
+        long long sv;
+        if (size_ == 2) {
+            sv = *(short*)p;
+            v = *(unsigned short*)p;
+        }
+        else if (size_ == 4) {
+            sv = *(int*)p;
+            v = *(unsigned int*)p;
+        }
+        else if (size_ == 8) {
+            sv = *(long long*)p;
+            v = *(unsigned long long*)p;
+        }
+#ifdef __SIZEOF_INT128__
+        else if (size_ == 16) {
+            unsigned __int128 u;
+            memcpy(&u, p, sizeof(u));
+            *--s = ')';
+            s = format_hex(u, 16, s);
+            s = format_hex(u >> 64, 16, s);
+            s -= 4;
+            memcpy(s, " (0x", 4);
+            bool neg = k == PRIM_SIGNED && (__int128)u < 0;
+            s = format_dec128(neg ? -u : u, s);
+            if (neg) *--s = '-';
+            emit_raw(s, end - s);
+            return;
+        }
+#endif
+        else {
+            emit("unimplemented primitive '%s'\n", name_.c_str());
+            return;
+        }
+
+        *--s = ')';
+        s = format_hex(v, size_ * 2, s);
+        s -= 4;
+        memcpy(s, " (0x", 4);
+        if (k == PRIM_SIGNED && sv < 0) {
+            s = format_dec(-(unsigned long long)sv, s);
+            *--s = '-';
+        }
+        else {
+            s = format_dec(k == PRIM_SIGNED ? sv : v, s);
+        }
+        emit_raw(s, end - s);
+//        printf(" : %s\n", name_.c_str());
+    }
+
+    static int formatFloat(void* p, int size, char* buf, int len) {
+        if (size == sizeof(float)) return format_float(*(float*)p, buf, len);
+        if (size == sizeof(double)) return format_float(*(double*)p, buf, len);
+        if (size == sizeof(long double)) {
+            return format_float(*(long double*)p, buf, len);
+        }
+        return -1;
+    }
+
+    int formatComplex(void* p, char* buf, int len) {
+        int half = size_ / 2;
+        int n = formatFloat(p, half, buf, len / 2);
+        if (n < 0) return -1;
+        buf[n++] = ' ';
+        buf[n++] = '+';
+        buf[n++] = ' ';
+        int m = formatFloat((char*)p + half, half, buf + n, len - n - 1);
+        if (m < 0) return -1;
+        n += m;
+        buf[n++] = 'i';
+        return n;
+    }
+
+    virtual string name() { return name_; }
+
+    virtual int size() { return size_; }
+
+    bool complex() const { return encoding_ == DW_ATE_complex_float; }
+
+    PrimClass klass() const {
+        switch (encoding_) {
+        case DW_ATE_boolean:
+            return PRIM_BOOL;
+        case DW_ATE_float:
+        case DW_ATE_complex_float:
+            return PRIM_FLOAT;
+        case DW_ATE_signed_char:
+        case DW_ATE_unsigned_char:
+            if (size_ == 1) return PRIM_CHAR;
+            return encoding_ == DW_ATE_signed_char ?
+                PRIM_SIGNED : PRIM_UNSIGNED;
+        case DW_ATE_signed:
+            return size_ == 1 ? PRIM_CHAR : PRIM_SIGNED;
+        case DW_ATE_unsigned:
+        case DW_ATE_UTF:
+            return size_ == 1 ? PRIM_CHAR : PRIM_UNSIGNED;
+        }
+        // Old producers may omit DW_AT_encoding.
+        if (name_.find("bool") != string::npos) return PRIM_BOOL;
+        if (size_ == 1) return PRIM_CHAR;
+        if (name_.find("float") != string::npos ||
+            name_.find("double") != string::npos)
+        {
+            return PRIM_FLOAT;
+        }
+        if (name_.find("unsigned") != string::npos) return PRIM_UNSIGNED;
+        return PRIM_SIGNED;
+    }
+
+    virtual size_t memory() {
+        return sizeof(*this) + heap_size(name_);
+    }
+
+    virtual string key() {
+        ostringstream oss;
+        oss << "prim " << name_ << " " << size_ << " " << encoding_;
+        return oss.str();
+    }
+
+private:
+    string name_;
+    int size_;
+    int encoding_;
+};
+
+// Applies an operation on the DWARF stack which needs no context, with
+// room for one more value.  Returns false if `a' is not such an
+// operation or it fails, e.g. for a deref of unreadable memory.
+static bool eval_stack_op(int a, Dwarf_Unsigned n, uintptr_t* stack,
+                          int* psp)
+{
+    int& sp = *psp;
+    if (a == DW_OP_dup && sp) {
+        stack[sp] = stack[sp-1];
+        sp++;
+    }
+    else if (a == DW_OP_over && sp >= 2) {
+        stack[sp] = stack[sp-2];
+        sp++;
+    }
+    else if (a == DW_OP_drop && sp) {
+        sp--;
+    }
+    else if (a == DW_OP_swap && sp >= 2) {
+        swap(stack[sp-1], stack[sp-2]);
+    }
+    else if (a >= DW_OP_lit0 && a <= DW_OP_lit31) {
+        stack[sp++] = a - DW_OP_lit0;
+    }
+    else if (a >= DW_OP_const1u && a <= DW_OP_consts) {
+        stack[sp++] = n;
+    }
+    else if (a == DW_OP_plus_uconst && sp) {
+        stack[sp-1] += n;
+    }
+    else if (a == DW_OP_plus && sp >= 2) {
+        sp--;
+        stack[sp-1] += stack[sp];
+    }
+    else if (a == DW_OP_minus && sp >= 2) {
+        sp--;
+        stack[sp-1] -= stack[sp];
+    }
+    else if (a == DW_OP_deref && sp) {
+        uintptr_t v;
+        if (read_bounded(&v, (void*)stack[sp-1], sizeof(v)) !=
+            sizeof(v))
+        {
+            return false;
+        }
+        stack[sp-1] = v;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Evaluates a location expression of a member of the object at `p', such
+// as the one for a virtual base which reads its offset from the vtable.
+// Returns 0 if it can't.
+static char* eval_member_loc(const vector<Dwarf_Loc>& ops, char* p) {
+    static const int STACK_SIZE = 16;
+    uintptr_t stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = (uintptr_t)p;
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (sp == STACK_SIZE) return 0;
+        if (!eval_stack_op(ops[i].lr_atom, ops[i].lr_number, stack, &sp)) {
+            return 0;
+        }
+    }
+    return sp ? (char*)stack[sp-1] : 0;
+}
+
+class DumpStruct : public DumpUnit {
+public:
     DumpStruct(Dwarf_Die die, Dwarf_Half tag) {
         int ret;
         Dwarf_Error err;
         Dwarf_Die child;
 
         tag_ = tag;
+        size_ = getSize(die);
+        // Only classes with a vptr have DW_AT_containing_type.
+        polymorphic_ =
+            getType(die, DW_AT_containing_type, "containing_type") != 0;
 
         name_ = getName(die);
         if (name_ == "<no name>") {
             int id = getType(die, DW_AT_specification, "specification");
-            DumpUnit* u = id2unit[id];
+            DumpUnit* u = find_unit(id);
             if (u) name_ = u->name();
             else return;  // Ignore unnamed type.
         }
-        types[name_] = this;
+        // A declaration must not hide the definition.
+        if (size_ >= 0 || types.find(name_) == types.end()) {
+            types[name_] = this;
+        }
+        formatter = find_formatter(name_);
 
         ret = dwarf_child(die, &child, &err);
         if (ret == DW_DLV_NO_ENTRY) return;
@@ -366,157 +1677,533 @@ public:
         }
     }
 
+    DumpStruct(const IndexReader& r, const IndexUnit& rec) {
+        tag_ = rec.tag;
+        size_ = rec.size;
+        polymorphic_ = rec.extra;
+        name_ = r.str(rec.name);
+        formatter = find_formatter(name_);
+        const IndexMember* mems = r.table<IndexMember>(IDX_MEMBERS);
+        const IndexOp* ops = r.table<IndexOp>(IDX_EXPRS);
+        for (uint32_t i = rec.first; i < rec.first + rec.count; i++) {
+            Member mem;
+            mem.name = r.str(mems[i].name);
+            mem.type = mems[i].type;
+            mem.loc = mems[i].loc;
+            mem.bits = mems[i].bits;
+            mem.shift = mems[i].shift;
+            mem.unit = mems[i].unit;
+            mem.expr = -1;
+            if (mem.loc == LOC_EXPR) {
+                mem.expr = exprs_.size();
+                exprs_.push_back(vector<Dwarf_Loc>(mems[i].expr_count));
+                for (uint32_t j = 0; j < mems[i].expr_count; j++) {
+                    Dwarf_Loc& op = exprs_.back()[j];
+                    memset(&op, 0, sizeof(op));
+                    op.lr_atom = ops[mems[i].expr_first + j].atom;
+                    op.lr_number = ops[mems[i].expr_first + j].number;
+                }
+            }
+            members_.push_back(mem);
+        }
+    }
+
+    virtual void save(IndexWriter* w, IndexUnit* rec) {
+        rec->tag = tag_;
+        rec->size = size_;
+        rec->extra = polymorphic_;
+        rec->name = w->str(name_);
+        rec->first = w->members.size();
+        rec->count = members_.size();
+        for (size_t i = 0; i < members_.size(); i++) {
+            const Member& m = members_[i];
+            IndexMember mem;
+            memset(&mem, 0, sizeof(mem));
+            mem.name = w->str(m.name);
+            mem.type = m.type;
+            mem.loc = m.loc;
+            mem.bits = m.bits;
+            mem.shift = m.shift;
+            mem.unit = m.unit;
+            if (m.expr >= 0) {
+                const vector<Dwarf_Loc>& ops = exprs_[m.expr];
+                mem.expr_first = w->exprs.size();
+                mem.expr_count = ops.size();
+                for (size_t j = 0; j < ops.size(); j++) {
+                    IndexOp op = { ops[j].lr_atom, 0, ops[j].lr_number };
+                    w->exprs.push_back(op);
+                }
+            }
+            w->members.push_back(mem);
+        }
+    }
+
     virtual void dump(void* p) {
         disp_ptrs.insert(p);
 
-        static int nest_level = 0;
-
+        if (formatter) {
+            formatter->fn(p, formatter->arg);
+            return;
+        }
         if (nest_level > DUMP_RECURSIVE_LEVEL*2) {
-            printf("{ ... }");
+            emit("{ ... }");
             return;
         }
 
-        printf("{\n");
+        emit("{\n");
         nest_level += 2;
-        for (vector<Member>::iterator ite = members_.begin();
-             ite != members_.end(); ++ite)
-        {
-            Member* mem = &*ite;
-            char* mp = (char*)p;
-            mp += mem->loc;
-            for (int i = 0; i < nest_level; i++) printf(" ");
-            printf("%s = ", mem->name.c_str());
-            DumpUnit* u = id2unit[mem->type];
-            if (u) {
-                u->dump(mp);
-                printf(" : %s\n", u->name().c_str());
-            }
-            else {
-                printf("???\n");
-            }
+        for (size_t i = 0; i < members_.size(); i++) {
+            dumpMember(i, p);
         }
         nest_level -= 2;
-        for (int i = 0; i < nest_level; i++) printf(" ");
-        printf("}");
+        for (int i = 0; i < nest_level; i++) emit(" ");
+        emit("}");
+    }
+
+    // One line of dump, for a member of the object at `p'.
+    void dumpMember(size_t index, void* p) {
+        Member* mem = &members_[index];
+        // Static members have no location.
+        if (mem->loc == -1) return;
+        char* mp = memberAddr(*mem, (char*)p);
+        for (int i = 0; i < nest_level; i++) emit(" ");
+        emit("%s = ", mem->name.c_str());
+        DumpUnit* u = find_unit(mem->type);
+        if (u && !mp) {
+            emit("<unknown location> : %s\n", u->name().c_str());
+        }
+        else if (u && mem->bits) {
+            dumpBits(*mem, mp, u);
+            emit(" : %s:%d\n", u->name().c_str(), mem->bits);
+        }
+        else if (u) {
+            u->dump(mp);
+            emit(" : %s\n", u->name().c_str());
+        }
+        else {
+            emit("???\n");
+        }
     }
 
     virtual string name() {
         return name_;
     }
 
-private:
-    Dwarf_Half tag_;
-    string name_;
+    virtual int size() {
+        return size_;
+    }
+
     struct Member {
         string name;
         int type;
+        // The byte offset, -1 for static members, or LOC_EXPR if it
+        // depends on the object.
         int loc;
+        // A bitfield is `bits' bits from bit `shift' of the `unit' bytes
+        // at `loc', which are loaded as one integer.  0 bits otherwise.
+        unsigned char bits;
+        unsigned char shift;
+        unsigned char unit;
+        // The location expression of a LOC_EXPR member in exprs_.
+        int expr;
     };
-    vector<Member> members_;
 
-    void addMember(Dwarf_Die die) {
-        Dwarf_Half tag = getTag(die);
-        if (tag == DW_TAG_member) {
-            Member mem;
-            mem.name = getName(die);
-            mem.type = getType(die);
-            if (tag_ == DW_TAG_structure_type) mem.loc = getLoc(die);
-            else mem.loc = 0;
-            members_.push_back(mem);
-        }
-        else if (tag == DW_TAG_inheritance) {
-            Member mem;
-            mem.name = "<inherit>";
-            mem.type = getType(die);
-            mem.loc = getLoc(die);
-            members_.push_back(mem);
+    const vector<Member>& members() const {
+        return members_;
+    }
+
+    // The address of a member of the object at `p', or 0.  For a copy in
+    // a live MemImage, the expression runs on the original and the member
+    // is copied too.  Copies in a dump_log record have no such original.
+    char* memberAddr(const Member& mem, char* p) const {
+        if (mem.loc != LOC_EXPR) return p + mem.loc;
+        if (mem_image) {
+            DumpUnit* u = find_unit(mem.type);
+            if (!mem_image->live || !u) return 0;
+            char* orig = (char*)mem_image->original(p);
+            char* mp = eval_member_loc(exprs_[mem.expr], orig);
+            return mp ? (char*)mem_image->find(mp, max(u->size(), 1)) : 0;
         }
+        char* mp = eval_member_loc(exprs_[mem.expr], p);
+        return mp && is_readable(mp) ? mp : 0;
     }
 
-};
+    // The value of a bitfield at `p', the address of its unit.
+    static unsigned long long loadBits(const Member& mem, const char* p,
+                                       bool sign) {
+        unsigned long long v;
+        switch (mem.unit) {
+        case 1: { uint8_t u; memcpy(&u, p, 1); v = u; break; }
+        case 2: { uint16_t u; memcpy(&u, p, 2); v = u; break; }
+        case 4: { uint32_t u; memcpy(&u, p, 4); v = u; break; }
+        default: memcpy(&v, p, 8); break;
+        }
+        v = v >> mem.shift & (~0ULL >> (64 - mem.bits));
+        if (sign && mem.bits < 64 && (v >> (mem.bits - 1) & 1)) {
+            v |= ~0ULL << mem.bits;
+        }
+        return v;
+    }
 
-class DumpTypedef : public DumpUnit {
-public:
-    DumpTypedef(Dwarf_Die die) {
-        type_ = getType(die);
-        name_ = getName(die);
-        types[name_] = this;
+    // Prints a bitfield of type `u' at `p' widened to `u', so that it
+    // prints as any other value of `u'.
+    static void dumpBits(const Member& mem, const char* p, DumpUnit* u) {
+        unsigned long long v = loadBits(mem, p, signedBits(u));
+        char buf[sizeof(v)] = {};
+        memcpy(buf, &v, min(max(u->size(), 0), (int)sizeof(v)));
+        u->dump(buf);
     }
 
-    virtual void dump(void* p) {
-        DumpUnit* u = id2unit[type_];
-        if (u) u->dump(p);
-        else printf("<void>");
+    // Whether a bitfield of type `u' is sign extended.
+    static bool signedBits(DumpUnit* u) {
+        DumpPrim* prim = dynamic_cast<DumpPrim*>(strip_unit(u));
+        if (!prim) return false;
+        PrimClass k = prim->klass();
+        return k == PRIM_SIGNED ||
+            (k == PRIM_CHAR && prim->name().find("unsigned") == string::npos);
     }
 
-    virtual string name() {
-        return name_;
+    bool polymorphic() const {
+        return polymorphic_;
     }
 
-private:
-    string name_;
-    int type_;
-};
+    struct Layout {
+        int size;
+        int members;
+        int sum_members;
+        int holes;
+        int sum_holes;
+        int padding;
+        int straddles;
+    };
 
-class DumpFunc : public DumpUnit {
-public:
-    DumpFunc(Dwarf_Die die) {
-        int ret;
-        Dwarf_Error err;
-        Dwarf_Die child;
+    // Computes holes, tail padding and cache line usage from member
+    // offsets.  Prints it like pahole does if `print' is set.
+    Layout layout(bool print) {
+        static const int CL = DUMP_CACHELINE_SIZE;
+        bool is_union = tag_ == DW_TAG_union_type;
+        Layout l;
+        memset(&l, 0, sizeof(l));
+        l.size = size_;
 
-        ret = dwarf_child(die, &child, &err);
-        if (ret == DW_DLV_NO_ENTRY) return;
-        if (ret != DW_DLV_OK) {
-            print_error("dwarf_child", ret, err);
-            throw DwarfException();
+        if (print) {
+            emit("%s %s {\n", is_union ? "union" : "struct", name_.c_str());
         }
-        args_.push_back(getType(child));
+        int end = 0;
+        int line = 0;
+        for (vector<Member>::iterator ite = members_.begin();
+             ite != members_.end(); ++ite)
+        {
+            Member* mem = &*ite;
+            // Static members have no location, and virtual bases are
+            // placed by the most derived class.
+            if (mem->loc < 0) continue;
+            DumpUnit* u = find_unit(mem->type);
+            int size = u ? u->size() : -1;
+            if (size < 0) size = 0;
+            // Bitfields share their unit with their neighbours.
+            if (mem->bits) size = mem->unit;
+            l.members++;
 
-        while (1) {
-            ret = dwarf_siblingof(dbg, child, &child, &err);
-            if (ret == DW_DLV_NO_ENTRY) {
-                break;
+            if (!is_union && mem->loc > end) {
+                int hole = mem->loc - end;
+                l.holes++;
+                l.sum_holes += hole;
+                if (print) {
+                    emit("\n    /* XXX %d bytes hole, try to pack */\n\n",
+                         hole);
+                }
             }
-            else if (ret != DW_DLV_OK) {
-                print_error("dwarf_siblingof", ret, err);
-                throw DwarfException();
+            if (mem->loc / CL > line) {
+                line = mem->loc / CL;
+                if (print) {
+                    emit("    /* --- cacheline %d boundary (%d bytes) --- */\n",
+                         line, line * CL);
+                }
             }
-            args_.push_back(getType(child));
+            bool straddle =
+                size > 0 && mem->loc / CL != (mem->loc + size - 1) / CL;
+            if (straddle) l.straddles++;
+
+            if (print) {
+                char bits[32] = "";
+                char loc[32];
+                if (mem->bits) {
+                    sprintf(bits, ":%d", mem->bits);
+                    sprintf(loc, "%d:%d", mem->loc, mem->shift);
+                }
+                else {
+                    sprintf(loc, "%d", mem->loc);
+                }
+                string decl = (u ? u->name() : "???") + " " + mem->name +
+                    bits + ";";
+                emit("    %-40s /* %5s %5d */%s\n",
+                     decl.c_str(), loc, size,
+                     straddle ? " /* XXX straddles cacheline */" : "");
+            }
+
+            if (is_union) l.sum_members = max(l.sum_members, size);
+            else l.sum_members += max(0, mem->loc + size - max(end, mem->loc));
+            end = max(end, mem->loc + size);
         }
-        type_ = getType(die);
+        if (size_ > end) l.padding = size_ - end;
+
+        if (print) {
+            emit("\n    /* size: %d, cachelines: %d, members: %d */\n",
+                 size_, size_ > 0 ? (size_ + CL - 1) / CL : 0, l.members);
+            emit("    /* sum members: %d, holes: %d, sum holes: %d */\n",
+                 l.sum_members, l.holes, l.sum_holes);
+            if (l.padding) emit("    /* padding: %d */\n", l.padding);
+            if (l.straddles) {
+                emit("    /* members straddling cachelines: %d */\n",
+                     l.straddles);
+            }
+            emit("};\n");
+        }
+        return l;
     }
 
+    virtual size_t memory() {
+        size_t size = sizeof(*this) + heap_size(name_);
+        size += members_.capacity() * sizeof(Member);
+        for (size_t i = 0; i < members_.size(); i++) {
+            size += heap_size(members_[i].name);
+        }
+        size += exprs_.capacity() * sizeof(exprs_[0]);
+        for (size_t i = 0; i < exprs_.size(); i++) {
+            size += exprs_[i].capacity() * sizeof(Dwarf_Loc);
+        }
+        return size;
+    }
+
+    virtual string key() {
+        ostringstream oss;
+        oss << "struct " << tag_ << " " << name_ << " " << size_;
+        for (size_t i = 0; i < members_.size(); i++) {
+            const Member& m = members_[i];
+            oss << " {" << m.name << " " << m.loc;
+            if (m.bits) {
+                oss << ":" << (int)m.shift << ":" << (int)m.bits;
+            }
+            if (m.expr >= 0) {
+                const vector<Dwarf_Loc>& ops = exprs_[m.expr];
+                for (size_t j = 0; j < ops.size(); j++) {
+                    oss << " " << (int)ops[j].lr_atom << "/"
+                        << ops[j].lr_number;
+                }
+            }
+            oss << " (" << unit_key(m.type) << ")}";
+        }
+        return oss.str();
+    }
+
+private:
+    Dwarf_Half tag_;
+    string name_;
+    int size_;
+    bool polymorphic_;
+    vector<Member> members_;
+    vector<vector<Dwarf_Loc> > exprs_;
+
+    void addMember(Dwarf_Die die) {
+        Dwarf_Half tag = getTag(die);
+        if (tag != DW_TAG_member && tag != DW_TAG_inheritance) return;
+
+        Member mem;
+        mem.name = tag == DW_TAG_member ? getName(die) : "<inherit>";
+        mem.type = getType(die);
+        mem.bits = mem.shift = mem.unit = 0;
+        mem.expr = -1;
+        vector<Dwarf_Loc> ops;
+        // Members of unions may have no location.
+        mem.loc = getLoc(die, &ops);
+        if (mem.loc == -1 && tag_ == DW_TAG_union_type) mem.loc = 0;
+        if (mem.loc == LOC_EXPR) {
+            mem.expr = exprs_.size();
+            exprs_.push_back(ops);
+        }
+        if (tag == DW_TAG_member) setBits(die, &mem);
+        members_.push_back(mem);
+    }
+
+    // Finds the bits of a bitfield from DW_AT_data_bit_offset, which
+    // counts from the start of the struct, or DWARF 2's DW_AT_bit_offset,
+    // which counts from the most significant bit of the DW_AT_byte_size
+    // unit at `loc'.  The unit to load is the smallest aligned one in the
+    // struct which holds all the bits.  Bits are numbered little endian.
+    void setBits(Dwarf_Die die, Member* mem) {
+        int bits = getAttrInt(die, DW_AT_bit_size, "bit_size");
+        if (bits <= 0 || bits > 64) return;
+        int bit = getAttrInt(die, DW_AT_data_bit_offset, "data_bit_offset");
+        if (bit < 0) {
+            int offset = getAttrInt(die, DW_AT_bit_offset, "bit_offset");
+            int bytes = getAttrInt(die, DW_AT_byte_size, "byte_size");
+            if (offset < 0 || bytes <= 0 || mem->loc < 0) return;
+            bit = mem->loc * 8 + bytes * 8 - offset - bits;
+        }
+        int loc = bit / 8;
+        int unit = 8;
+        for (int u = 1; u <= 8; u *= 2) {
+            int l = bit / 8 / u * u;
+            if (bit - l * 8 + bits <= u * 8 && (size_ < 0 || l + u <= size_)) {
+                loc = l;
+                unit = u;
+                break;
+            }
+        }
+        if (bit - loc * 8 + bits > unit * 8) return;
+        mem->loc = loc;
+        mem->bits = bits;
+        mem->shift = bit - loc * 8;
+        mem->unit = unit;
+    }
+
+};
+
+class DumpTypedef : public DumpUnit {
+public:
+    DumpTypedef(Dwarf_Die die) {
+        type_ = getType(die);
+        name_ = getName(die);
+        types[name_] = this;
+        formatter = find_formatter(name_);
+    }
+
+    DumpTypedef(const IndexReader& r, const IndexUnit& rec) {
+        type_ = rec.type;
+        name_ = r.str(rec.name);
+        formatter = find_formatter(name_);
+    }
+
+    virtual void save(IndexWriter* w, IndexUnit* rec) {
+        rec->type = type_;
+        rec->name = w->str(name_);
+    }
+
+    int type() const { return type_; }
+
     virtual void dump(void* p) {
+        if (formatter) {
+            formatter->fn(p, formatter->arg);
+            return;
+        }
+        DumpUnit* u = find_unit(type_);
+        if (u) u->dump(p);
+        else emit("<void>");
+    }
+
+    virtual string name() {
+        return name_;
+    }
+
+    virtual int size() {
+        DumpUnit* u = find_unit(type_);
+        return u ? u->size() : -1;
+    }
+
+    virtual size_t memory() {
+        return sizeof(*this) + heap_size(name_);
+    }
+
+    virtual string key() {
+        return "typedef " + name_ + " (" + unit_key(type_) + ")";
+    }
+
+private:
+    string name_;
+    int type_;
+};
+
+class DumpFunc : public DumpUnit {
+public:
+    DumpFunc(Dwarf_Die die) {
+        int ret;
+        Dwarf_Error err;
+        Dwarf_Die child;
+
+        ret = dwarf_child(die, &child, &err);
+        if (ret == DW_DLV_NO_ENTRY) return;
+        if (ret != DW_DLV_OK) {
+            print_error("dwarf_child", ret, err);
+            throw DwarfException();
+        }
+        args_.push_back(getType(child));
+
+        while (1) {
+            ret = dwarf_siblingof(dbg, child, &child, &err);
+            if (ret == DW_DLV_NO_ENTRY) {
+                break;
+            }
+            else if (ret != DW_DLV_OK) {
+                print_error("dwarf_siblingof", ret, err);
+                throw DwarfException();
+            }
+            args_.push_back(getType(child));
+        }
+        type_ = getType(die);
+    }
+
+    DumpFunc(const IndexReader& r, const IndexUnit& rec) {
+        type_ = rec.type;
+        const int32_t* args = r.table<int32_t>(IDX_ARGS);
+        args_.assign(args + rec.first, args + rec.first + rec.count);
+    }
+
+    virtual void save(IndexWriter* w, IndexUnit* rec) {
+        rec->type = type_;
+        rec->first = w->args.size();
+        rec->count = args_.size();
+        w->args.insert(w->args.end(), args_.begin(), args_.end());
+    }
+
+    // How dump() shows a function named `fname' of this type.
+    string signature(const string& fname) {
         string type = "???";
         string args = "";
-        DumpUnit* u = id2unit[type_];
+        DumpUnit* u = find_unit(type_);
         if (u) type = u->name();
         for (size_t i = 0; i < args_.size(); i++) {
-            u = id2unit[args_[i]];
+            u = find_unit(args_[i]);
             if (i != 0) args += ", ";
             if (u) args += u->name();
             else args += "???";
         }
+        return type + " " + fname + "(" + args + ")";
+    }
 
+    virtual void dump(void* p) {
         void** vp = (void**)p;
         for (vector<func>::const_iterator ite = funcs.begin();
              ite != funcs.end(); ++ite)
         {
             if (ite->low == *vp) {
-                printf("%s %s(%s)",
-                       type.c_str(), ite->name.c_str(), args.c_str());
+                emit("%s", signature(ite->name).c_str());
                 return;
             }
         }
-        printf("%s %s(%s)",
-               type.c_str(), "???", args.c_str());
+        emit("%s", signature("???").c_str());
     }
 
     virtual string name() {
         return "func";
     }
 
+    virtual int size() {
+        return -1;
+    }
+
+    virtual size_t memory() {
+        return sizeof(*this) + args_.capacity() * sizeof(int);
+    }
+
+    virtual string key() {
+        string k = "func (" + unit_key(type_) + ")";
+        for (size_t i = 0; i < args_.size(); i++) {
+            k += " (" + unit_key(args_[i]) + ")";
+        }
+        return k;
+    }
+
 private:
     int type_;
     vector<int> args_;
@@ -531,6 +2218,7 @@ public:
         Dwarf_Die child;
 
         name_ = getName(die);
+        size_ = getSize(die);
 
         ret = dwarf_child(die, &child, &err);
         if (ret == DW_DLV_NO_ENTRY) return;
@@ -553,15 +2241,82 @@ public:
         }
     }
 
+    DumpEnum(const IndexReader& r, const IndexUnit& rec) {
+        name_ = r.str(rec.name);
+        size_ = rec.size;
+        const IndexEnum* enums = r.table<IndexEnum>(IDX_ENUMS);
+        for (uint32_t i = rec.first; i < rec.first + rec.count; i++) {
+            enums_[enums[i].value] = r.str(enums[i].name);
+        }
+    }
+
+    virtual void save(IndexWriter* w, IndexUnit* rec) {
+        rec->name = w->str(name_);
+        rec->size = size_;
+        rec->first = w->enums.size();
+        rec->count = enums_.size();
+        for (map<int, string>::const_iterator ite = enums_.begin();
+             ite != enums_.end(); ++ite)
+        {
+            IndexEnum e;
+            e.value = ite->first;
+            e.name = w->str(ite->second);
+            w->enums.push_back(e);
+        }
+    }
+
     virtual void dump(void* p) {
-        int* ip = (int*)p;
-        printf("%s", enums_[*ip].c_str());
+        // Unknown values print nothing, without growing the table.
+        map<int, string>::const_iterator ite = enums_.find(value(p));
+        emit("%s", ite != enums_.end() ? ite->second.c_str() : "");
+    }
+
+    // Reads a value of our own size.  A small enum may have an unsigned
+    // underlying type, so its zero-extended value is used if only that
+    // one is an enumerator.
+    int value(const void* p) const {
+        int n = size_ > 0 && size_ < 4 ? size_ : 4;
+        unsigned int u = 0;
+        memcpy(&u, p, n);
+        if (n == 4) return u;
+        int shift = 32 - n * 8;
+        int v = (int)(u << shift) >> shift;
+        return enums_.count(v) || !enums_.count(u) ? v : u;
+    }
+
+    const map<int, string>& enums() const {
+        return enums_;
     }
 
     virtual string name() {
         return name_;
     }
 
+    virtual int size() {
+        return size_;
+    }
+
+    virtual size_t memory() {
+        size_t size = sizeof(*this) + heap_size(name_);
+        for (map<int, string>::const_iterator ite = enums_.begin();
+             ite != enums_.end(); ++ite)
+        {
+            size += MAP_NODE_SIZE + sizeof(*ite) + heap_size(ite->second);
+        }
+        return size;
+    }
+
+    virtual string key() {
+        ostringstream oss;
+        oss << "enum " << name_ << " " << size_;
+        for (map<int, string>::const_iterator ite = enums_.begin();
+             ite != enums_.end(); ++ite)
+        {
+            oss << " " << ite->second << "=" << ite->first;
+        }
+        return oss.str();
+    }
+
 private:
     void add(Dwarf_Die die) {
         Dwarf_Attribute attr;
@@ -592,6 +2347,7 @@ private:
     }
 
     string name_;
+    int size_;
     map<int, string> enums_;
 
 };
@@ -603,74 +2359,183 @@ public:
         type_ = getType(die);
     }
 
+    DumpCv(const IndexReader&, const IndexUnit& rec) {
+        tag_ = rec.tag;
+        type_ = rec.type;
+    }
+
+    virtual void save(IndexWriter*, IndexUnit* rec) {
+        rec->tag = tag_;
+        rec->type = type_;
+    }
+
+    int type() const { return type_; }
+
     virtual void dump(void* p) {
-        DumpUnit* u = id2unit[type_];
-        u->dump(p);
+        DumpUnit* u = find_unit(type_);
+        if (u) u->dump(p);
+        else emit("<void>");
     }
 
     virtual string name() {
-        DumpUnit* u = id2unit[type_];
+        DumpUnit* u = find_unit(type_);
+        if (!u) return "void";
         return u->name();
     }
 
+    virtual int size() {
+        DumpUnit* u = find_unit(type_);
+        return u ? u->size() : -1;
+    }
+
+    virtual size_t memory() {
+        return sizeof(*this);
+    }
+
+    virtual string key() {
+        ostringstream oss;
+        oss << "cv " << tag_ << " (" << unit_key(type_) << ")";
+        return oss.str();
+    }
+
 private:
     Dwarf_Half tag_;
     int type_;
 };
 
+// Returns the dynamic type of a polymorphic object if it differs from
+// the static type `u'.  Objects seen through a non-primary base have a
+// secondary vptr which isn't indexed, so they keep their static type.
+static DumpStruct* dynamic_type(DumpUnit* u, void* obj) {
+    DumpStruct* st = dynamic_cast<DumpStruct*>(strip_unit(u));
+    if (!st || !st->polymorphic() || !is_readable(obj)) return 0;
+    unordered_map<void*, int>::const_iterator ite =
+        vtable_index.find(*(void**)obj);
+    if (ite == vtable_index.end()) return 0;
+    DumpStruct* dyn =
+        dynamic_cast<DumpStruct*>(strip_unit(find_unit(ite->second)));
+    return dyn != st ? dyn : 0;
+}
+
 class DumpPtr : public DumpUnit {
 public:
     DumpPtr(Dwarf_Die die, Dwarf_Half tag) {
         tag_ = tag;
         type_ = getType(die);
+        size_ = getSize(die);
+        if (size_ < 0) size_ = sizeof(void*);
+    }
+
+    DumpPtr(const IndexReader&, const IndexUnit& rec) {
+        tag_ = rec.tag;
+        type_ = rec.type;
+        size_ = rec.size;
+    }
+
+    virtual void save(IndexWriter*, IndexUnit* rec) {
+        rec->tag = tag_;
+        rec->type = type_;
+        rec->size = size_;
     }
 
+    int type() const { return type_; }
+
     virtual void dump(void* p) {
         void** vp = (void**)p;
 
+        // The pointer itself can't be read, so show where it is.
         if (!is_readable(p)) {
-            printf("%p <invalid ptr>", *vp);
+            tstats().unreadable_ptrs.add(1);
+            emit("[%p] <invalid ptr>", p);
             return;
         }
 
-        DumpUnit* u = id2unit[type_];
+        DumpUnit* u = find_unit(type_);
         if (!u) {
-            printf("%p", *vp);
+            emit("%p", *vp);
+            return;
+        }
+
+        // For a string, `u` can be `DumpPrim` or `DumpCv`.  Strings are
+        // read with read_bounded and functions are only looked up.
+        bool str = u->name() == "char";
+        bool func = dynamic_cast<DumpFunc*>(u) != 0;
+        void* target = *vp;
+        // dump_str reads live strings safely by itself.
+        if (mem_image && target && !func && !(str && mem_image->live)) {
+            target = mem_image->find(*vp, str ? 1 : max(u->size(), 1));
+            if (!target && !mem_image->live) {
+                emit("%p <not logged>", *vp);
+                return;
+            }
+        }
+        else if (!str && !func && !is_readable_range(target, u->size())) {
+            target = 0;
+        }
+        if (!str && !func && !target) {
+            tstats().unreadable_ptrs.add(1);
+            emit("%p <invalid ptr>", *vp);
             return;
         }
 
         if (dynamic_cast<DumpStruct*>(u)) {
-            if (disp_ptrs.find(*vp) != disp_ptrs.end()) {
-                printf("%p <previously shown>", *vp);
+            if (disp_ptrs.seen(*vp)) {
+                emit("%p <previously shown>", *vp);
                 return;
             }
         }
 
-        // For a string, `u` can be `DumpPrim` or `DumpCv`.
-        if (u->name() == "char") {
-            dump_str(*(char**)p);
+        // The dynamic type may be larger than what was read or checked.
+        DumpStruct* dyn = str || func ? 0 : dynamic_type(u, target);
+        void* dyn_target = 0;
+        if (dyn && mem_image) dyn_target = mem_image->find(*vp, dyn->size());
+        else if (dyn && is_readable_range(target, dyn->size())) {
+            dyn_target = target;
+        }
+        if (str) {
+            dump_str((char*)target, -1, *vp);
         }
-        else if (dynamic_cast<DumpFunc*>(u)) {
+        else if (dyn_target) {
+            dyn->dump(dyn_target);
+            emit(" [%p] (%s)", *vp, dyn->name().c_str());
+        }
+        else if (func) {
             u->dump(vp);
-            printf(" [%p]", *vp);
+            emit(" [%p]", *vp);
         }
         else {
-            u->dump(*vp);
-            printf(" [%p]", *vp);
+            u->dump(target);
+            emit(" [%p]", *vp);
         }
     }
 
     virtual string name() {
-        string p = (tag_ == DW_TAG_pointer_type) ? "*" : "&";
+        string p = tag_ == DW_TAG_pointer_type ? "*" :
+            tag_ == DW_TAG_rvalue_reference_type ? "&&" : "&";
         if (type_ == 0) return "void" + p;
-        DumpUnit* u = id2unit[type_];
+        DumpUnit* u = find_unit(type_);
         if (!u) return "???" + p;
         return u->name() + p;
     }
 
+    virtual int size() {
+        return size_;
+    }
+
+    virtual size_t memory() {
+        return sizeof(*this);
+    }
+
+    virtual string key() {
+        ostringstream oss;
+        oss << "ptr " << tag_ << " " << size_ << " (" << unit_key(type_) << ")";
+        return oss.str();
+    }
+
 private:
     Dwarf_Half tag_;
     int type_;
+    int size_;
 };
 
 class DumpArray : public DumpUnit {
@@ -692,12 +2557,25 @@ public:
         size_ = getUpperBound(child) + 1;
     }
 
+    DumpArray(const IndexReader&, const IndexUnit& rec) {
+        type_ = rec.type;
+        size_ = rec.extra;
+    }
+
+    virtual void save(IndexWriter*, IndexUnit* rec) {
+        rec->type = type_;
+        rec->extra = size_;
+    }
+
+    int type() const { return type_; }
+    int count() const { return size_; }
+
     virtual void dump(void* p) {
         if (size_ < 1) {
-            printf("{}");
+            emit("{}");
             return;
         }
-        DumpUnit* u = id2unit[type_];
+        DumpUnit* u = find_unit(type_);
         if (dynamic_cast<DumpPrim*>(u) && u->name() == "char") {
             dump_str((char*)p, size_);
 /*
@@ -715,38 +2593,144 @@ public:
 */
         }
         else if (u) {
-            printf("{ ");
+            emit("{ ");
             u->dump(p);
-            if (size_ > 1) printf(", ...");
-            printf(" }");
+            if (size_ > 1) emit(", ...");
+            emit(" }");
         }
         else {
-            printf("{ ???, ... }");
+            emit("{ ???, ... }");
         }
     }
 
     virtual string name() {
         ostringstream oss;
-        DumpUnit* u = id2unit[type_];
+        DumpUnit* u = find_unit(type_);
         if (u) oss << u->name();
         else oss << "???";
         oss << "[" << size_ << "]";
         return oss.str();
     }
 
+    virtual int size() {
+        DumpUnit* u = find_unit(type_);
+        int elem = u ? u->size() : -1;
+        return elem < 0 ? -1 : elem * size_;
+    }
+
+    virtual size_t memory() {
+        return sizeof(*this);
+    }
+
+    virtual string key() {
+        ostringstream oss;
+        oss << "array " << size_ << " (" << unit_key(type_) << ")";
+        return oss.str();
+    }
+
 private:
     int type_;
     int size_;
 };
 
-static void add_func(Dwarf_Die die) {
+// Skips typedefs and cv-qualifiers.
+static DumpUnit* strip_unit(DumpUnit* u) {
+    while (u) {
+        if (DumpTypedef* t = dynamic_cast<DumpTypedef*>(u)) {
+            u = find_unit(t->type());
+        }
+        else if (DumpCv* c = dynamic_cast<DumpCv*>(u)) {
+            u = find_unit(c->type());
+        }
+        else {
+            break;
+        }
+    }
+    return u;
+}
+
+// Out-of-line definitions of methods have their names in the declaration.
+static string getFuncName(Dwarf_Die die) {
+    static const Dwarf_Half refs[] = {
+        DW_AT_specification, DW_AT_abstract_origin
+    };
+    string name = getName(die);
+    for (int i = 0; i < 2 && name == "<no name>"; i++) {
+        Dwarf_Attribute attr;
+        Dwarf_Off off;
+        Dwarf_Die ref;
+        Dwarf_Error err;
+        if (getAttr(die, refs[i], "specification", &attr)) continue;
+        if (dwarf_global_formref(attr, &off, &err) != DW_DLV_OK) continue;
+        if (dwarf_offdie_b(dbg, off, 1, &ref, &err) != DW_DLV_OK) continue;
+        name = getName(ref);
+    }
+    return name;
+}
+
+static bool add_func(Dwarf_Die die) {
     func f;
-    f.name = getName(die);
     Dwarf_Addr low = getLowPc(die);
-    low += base_addr;
-    f.low = (void*)low;
-    f.high = (void*)getHighPc(die, low);
-    if (f.low && f.high) funcs.push_back(f);
+    Dwarf_Addr high = getHighPc(die, low);
+    if (!low || !high) return false;
+    f.name = getFuncName(die);
+    f.low = (void*)(low + base_addr);
+    f.high = (void*)(high + base_addr);
+    f.frame_base = getLocation(die, DW_AT_frame_base, "frame_base");
+    funcs.push_back(f);
+    return true;
+}
+
+static void add_local(Dwarf_Die die, Dwarf_Half tag) {
+    local l;
+    l.name = getName(die);
+    l.type = getType(die);
+    l.param = tag == DW_TAG_formal_parameter;
+    l.low = processing_scope_low;
+    l.high = processing_scope_high;
+    l.loc = getLocation(die, DW_AT_location, "location");
+    funcs[processing_func].locals.push_back(l);
+}
+
+static void add_global(Dwarf_Die die) {
+    vector<location> loc = getLocation(die, DW_AT_location, "location");
+    if (loc.size() != 1 || loc[0].ops.size() != 1 ||
+        loc[0].ops[0].lr_atom != DW_OP_addr)
+    {
+        return;
+    }
+    global g;
+    g.addr = (void*)(loc[0].ops[0].lr_number + base_addr);
+    g.type = getType(die);
+    // Definitions of static members refer to their declarations.
+    Dwarf_Attribute attr;
+    Dwarf_Off off;
+    Dwarf_Die decl;
+    Dwarf_Error err;
+    if (!g.type &&
+        !getAttr(die, DW_AT_specification, "specification", &attr) &&
+        dwarf_global_formref(attr, &off, &err) == DW_DLV_OK &&
+        dwarf_offdie_b(dbg, off, 1, &decl, &err) == DW_DLV_OK)
+    {
+        g.type = getType(decl);
+    }
+    if (g.type) globals.insert(make_pair(getFuncName(die), g));
+}
+
+static const func* find_func(void* pc) {
+    for (vector<func>::const_iterator ite = funcs.begin();
+         ite != funcs.end(); ++ite)
+    {
+        if (ite->low <= pc && pc < ite->high) return &*ite;
+    }
+    Dwarf_Addr a = (Dwarf_Addr)pc - base_addr;
+    for (size_t i = 0; i < split_units.size(); i++) {
+        SplitUnit& su = split_units[i];
+        if (su.loaded || a < su.low || a >= su.high) continue;
+        load_split(&su);
+        return find_func(pc);
+    }
+    return 0;
 }
 
 static void add_line(Dwarf_Die die) {
@@ -754,8 +2738,9 @@ static void add_line(Dwarf_Die die) {
     int f = getAttrInt(die, DW_AT_decl_file, "decl_file");
     v.line = getAttrInt(die, DW_AT_decl_line, "decl_line");
     if (v.line == -1 || f == -1) return;
-    if (srcfiles && f > 0 && f <= srcnum) {
-        v.file = srcfiles[f-1];
+    if (processing_cu_version < 5) f--;
+    if (srcfiles && f >= 0 && f < srcnum) {
+        v.file = srcfiles[f];
     }
     v.name = getName(die);
     v.type = getType(die);
@@ -763,7 +2748,9 @@ static void add_line(Dwarf_Die die) {
     variables[processing_cu].push_back(v);
 }
 
-static int open_info(Dwarf_Die die, int d) {
+// Builds units for a DIE tree.  `types_only' is for reading an evicted
+// group again, when functions and variables are already known.
+static int open_info(Dwarf_Die die, int d, bool types_only = false) {
     Dwarf_Error err;
     int ret;
 
@@ -771,51 +2758,92 @@ static int open_info(Dwarf_Die die, int d) {
         Dwarf_Half tag;
         Dwarf_Off aoff, off;
         DumpUnit* unit = 0;
+        // Variables below belong to this function.
+        int child_func = -1;
+        void* scope_low = processing_scope_low;
+        void* scope_high = processing_scope_high;
 
+        load_stats.dies++;
         tag = getTag(die);
 
         try {
             if (tag == DW_TAG_base_type) {
                 unit = new DumpPrim(die);
+                load_stats.units[DUMP_KIND_PRIM]++;
             }
             else if (tag == DW_TAG_structure_type ||
+                     tag == DW_TAG_class_type ||
                      tag == DW_TAG_union_type)
             {
                 unit = new DumpStruct(die, tag);
+                load_stats.units[DUMP_KIND_STRUCT]++;
             }
             else if (tag == DW_TAG_reference_type ||
+                     tag == DW_TAG_rvalue_reference_type ||
                      tag == DW_TAG_pointer_type)
             {
                 unit = new DumpPtr(die, tag);
+                load_stats.units[DUMP_KIND_PTR]++;
             }
             else if (tag == DW_TAG_const_type ||
                      tag == DW_TAG_volatile_type)
             {
                 unit = new DumpCv(die, tag);
+                load_stats.units[DUMP_KIND_CV]++;
             }
             else if (tag == DW_TAG_typedef) {
                 unit = new DumpTypedef(die);
+                load_stats.units[DUMP_KIND_TYPEDEF]++;
             }
             else if (tag == DW_TAG_subroutine_type) {
                 unit = new DumpFunc(die);
+                load_stats.units[DUMP_KIND_FUNC]++;
             }
             else if (tag == DW_TAG_array_type) {
                 unit = new DumpArray(die);
+                load_stats.units[DUMP_KIND_ARRAY]++;
             }
             else if (tag == DW_TAG_enumeration_type) {
                 unit = new DumpEnum(die);
+                load_stats.units[DUMP_KIND_ENUM]++;
+            }
+            else if (types_only) {
+                goto next;
             }
             else {
                 if (tag == DW_TAG_subprogram) {
-                    add_func(die);
+                    if (add_func(die)) {
+                        child_func = funcs.size() - 1;
+                        scope_low = scope_high = 0;
+                    }
+                }
+                else if (tag == DW_TAG_lexical_block) {
+                    child_func = processing_func;
+                    Dwarf_Addr low = getLowPc(die);
+                    Dwarf_Addr high = getHighPc(die, low);
+                    // Blocks with DW_AT_ranges get the outer scope.
+                    if (low && high) {
+                        scope_low = (void*)(low + base_addr);
+                        scope_high = (void*)(high + base_addr);
+                    }
                 }
                 else if (tag == DW_TAG_variable ||
                          tag == DW_TAG_formal_parameter)
                 {
                     add_line(die);
+                    if (processing_func >= 0) add_local(die, tag);
+                    else if (tag == DW_TAG_variable) add_global(die);
                 }
                 else if (tag == DW_TAG_compile_unit) {
-                    processing_cu = getName(die);
+                    // Split CUs are known by their skeletons.
+                    if (loading_split) {
+                        processing_cu = loading_split->name;
+                        processing_cu_low = loading_split->low;
+                    }
+                    else {
+                        processing_cu = getName(die);
+                        processing_cu_low = getLowPc(die);
+                    }
                 }
                 goto next;
             }
@@ -835,7 +2863,9 @@ static int open_info(Dwarf_Die die, int d) {
             return ret;
         }
 
-        id2unit[aoff] = unit;
+        unit->id = aoff + id_base;
+        id2unit[unit->id] = unit;
+        if (loading_group >= 0) groups[loading_group].ids.push_back(unit->id);
 /*
         for (int i = 0; i < d; i++) putc(' ', stdout);
 //        printf("<%d>%d: %s\n", aoff, tag, str);
@@ -846,7 +2876,16 @@ static int open_info(Dwarf_Die die, int d) {
         Dwarf_Die child;
         ret = dwarf_child(die, &child, &err);
         if (ret == DW_DLV_OK) {
-            open_info(child, d+1);
+            int saved_func = processing_func;
+            void* saved_low = processing_scope_low;
+            void* saved_high = processing_scope_high;
+            processing_func = child_func;
+            processing_scope_low = scope_low;
+            processing_scope_high = scope_high;
+            open_info(child, d+1, types_only);
+            processing_func = saved_func;
+            processing_scope_low = saved_low;
+            processing_scope_high = saved_high;
         }
         else if (ret == DW_DLV_ERROR) {
             print_error("dwarf_child", ret, err);
@@ -866,44 +2905,404 @@ static int open_info(Dwarf_Die die, int d) {
     return 0;
 }
 
-static int open_infos() {
-    Dwarf_Die die = 0;
-    Dwarf_Error err;
-    int ret;
+static int group_of(int id) {
+    int lo = 0, hi = groups.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (groups[mid].end <= id) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == (int)groups.size() || id < groups[lo].start) return -1;
+    return lo;
+}
 
-    Dwarf_Unsigned cu_header_length = 0;
-    Dwarf_Unsigned abbrev_offset = 0;
-    Dwarf_Half version_stamp = 0;
-    Dwarf_Half address_size = 0;
-    Dwarf_Unsigned next_cu_offset = 0;
+static void finish_group(int g) {
+    UnitGroup& grp = groups[g];
+    grp.bytes = 0;
+    for (size_t i = 0; i < grp.ids.size(); i++) {
+        grp.bytes += MAP_NODE_SIZE + sizeof(pair<int, DumpUnit*>);
+        grp.bytes += id2unit[grp.ids[i]]->memory();
+    }
+    grp.resident = true;
+    grp.last_use = ++use_clock;
+    resident_bytes += grp.bytes;
+}
 
-    while ((ret =
-            dwarf_next_cu_header(dbg, &cu_header_length, &version_stamp,
-                                 &abbrev_offset, &address_size,
-                                 &next_cu_offset, &err))
-           == DW_DLV_OK)
-    {
-        ret = dwarf_siblingof(dbg, NULL, &die, &err);
+static void materialize(int g) {
+    UnitGroup& grp = groups[g];
+    Dwarf_Die die;
+    Dwarf_Error err;
+    int ret = dwarf_offdie_b(dbg, grp.cu_die, grp.is_info, &die, &err);
+    if (ret != DW_DLV_OK) {
+        print_error("dwarf_offdie_b", ret, err);
+        return;
+    }
 
-        ret = dwarf_srcfiles(die, &srcfiles, &srcnum, &err);
-        if (ret != DW_DLV_OK) {
-            srcfiles = 0;
-            srcnum = 0;
-        }
+    int saved_base = id_base;
+    int saved_group = loading_group;
+    id_base = grp.is_info ? 0 : TYPES_ID_BASE;
+    loading_group = g;
+    grp.ids.clear();
+    open_info(die, 0, true);
+    finish_group(g);
+    id_base = saved_base;
+    loading_group = saved_group;
+    tstats().registry_loads.add(1);
+}
 
-        if (ret == DW_DLV_OK) {
-            ret = open_info(die, 0);
-            if (ret) return ret;
-        }
-        else if (ret == DW_DLV_NO_ENTRY) {
-            continue;
+static void evict(int g) {
+    UnitGroup& grp = groups[g];
+    set<DumpUnit*> dead;
+    for (size_t i = 0; i < grp.ids.size(); i++) {
+        map<int, DumpUnit*>::iterator ite = id2unit.find(grp.ids[i]);
+        if (ite == id2unit.end()) continue;
+        dead.insert(ite->second);
+        id2unit.erase(ite);
+    }
+    for (map<string, DumpUnit*>::iterator ite = types.begin();
+         ite != types.end(); )
+    {
+        if (dead.count(ite->second)) {
+            evicted_types[ite->first] = ite->second->id;
+            types.erase(ite++);
         }
-        else if (ret != DW_DLV_OK) {
-            print_error("dwarf_siblingof", ret, err);
-            return ret;
+        else {
+            ++ite;
         }
+    }
+    for (set<DumpUnit*>::iterator ite = dead.begin(); ite != dead.end();
+         ++ite)
+    {
+        delete *ite;
+    }
+    grp.ids.clear();
+    grp.resident = false;
+    resident_bytes -= grp.bytes;
+    tstats().registry_evictions.add(1);
+}
 
-        if (srcfiles) {
+// Only called between top-level calls, when no unit is in use.
+static void enforce_budget() {
+    while (memory_budget && resident_bytes > memory_budget) {
+        int victim = -1;
+        for (size_t g = 0; g < groups.size(); g++) {
+            const UnitGroup& grp = groups[g];
+            if (!grp.resident || grp.pinned) continue;
+            if (victim < 0 || grp.last_use < groups[victim].last_use) {
+                victim = g;
+            }
+        }
+        if (victim < 0) break;
+        evict(victim);
+    }
+}
+
+static void pin_unit(DumpUnit* u) {
+    if (!memory_budget || !u) return;
+    int g = group_of(u->id);
+    if (g >= 0) groups[g].pinned = true;
+}
+
+// Resolves a type id.  Follows type signatures and, with a memory budget,
+// reads evicted units again.
+static DumpUnit* find_unit(int id) {
+    if (id == 0) return 0;
+    if (id >= SIG_ID_BASE) {
+        map<int, int>::const_iterator a = sig_alias.find(id);
+        if (a == sig_alias.end()) return 0;
+        id = a->second;
+    }
+    map<int, DumpUnit*>::const_iterator ite = id2unit.find(id);
+    if (!memory_budget) {
+        return ite != id2unit.end() ? ite->second : 0;
+    }
+
+    int g = group_of(id);
+    if (ite != id2unit.end()) {
+        if (g >= 0) groups[g].last_use = ++use_clock;
+        tstats().registry_hits.add(1);
+        return ite->second;
+    }
+    if (g < 0 || groups[g].resident) return 0;
+    materialize(g);
+    ite = id2unit.find(id);
+    return ite != id2unit.end() ? ite->second : 0;
+}
+
+// Split units which are not read yet are read one by one until one of
+// them has the type, unless `load' is false.
+static DumpUnit* find_type(const string& name, bool load = true) {
+    map<string, DumpUnit*>::iterator ite = types.find(name);
+    if (ite != types.end()) return ite->second;
+    map<string, int>::iterator e = evicted_types.find(name);
+    if (e != evicted_types.end()) {
+        find_unit(e->second);
+        ite = types.find(name);
+        return ite != types.end() ? ite->second : 0;
+    }
+    for (size_t i = 0; load && i < split_units.size(); i++) {
+        if (split_units[i].loaded) continue;
+        load_split(&split_units[i]);
+        ite = types.find(name);
+        if (ite != types.end()) return ite->second;
+    }
+    return 0;
+}
+
+// Must be rebuilt after loading, as new classes may have been read.
+// Classes are kept by id and resolved when used, so that they may be
+// evicted with a memory budget.
+static void build_vtable_index() {
+    vtable_index.clear();
+    for (size_t i = 0; i < vtables.size(); i++) {
+        const string& name = vtables[i].name;
+        map<string, DumpUnit*>::const_iterator t = types.find(name);
+        if (t != types.end()) {
+            vtable_index[vtables[i].addr] = t->second->id;
+            continue;
+        }
+        map<string, int>::const_iterator e = evicted_types.find(name);
+        if (e != evicted_types.end()) vtable_index[vtables[i].addr] = e->second;
+    }
+}
+
+static map<DumpUnit*, string>* unit_keys;
+static map<string, int>* key_ids;
+
+// Keys embed the keys of the units they refer to as short ids, so two
+// types of the same name but different members stay apart.  A unit which
+// is still being keyed stands for itself by name, so recursive types end.
+static string unit_key(int id) {
+    DumpUnit* u = find_unit(id);
+    if (!u) return "void";
+    map<DumpUnit*, string>::iterator ite = unit_keys->find(u);
+    if (ite != unit_keys->end()) return ite->second;
+    (*unit_keys)[u] = "recursive " + u->name();
+    string k = u->key();
+    int kid = key_ids->insert(make_pair(k, (int)key_ids->size())).first->second;
+    ostringstream oss;
+    oss << "#" << kid;
+    return (*unit_keys)[u] = oss.str();
+}
+
+// Every CU has its own copy of the types in the headers it includes.
+// Merges units with the same key into one and frees the others.
+static void unify_units() {
+    map<DumpUnit*, string> keys;
+    map<string, int> ids;
+    unit_keys = &keys;
+    key_ids = &ids;
+    map<string, DumpUnit*> canon;
+    map<DumpUnit*, DumpUnit*> dups;
+    for (map<int, DumpUnit*>::iterator ite = id2unit.begin();
+         ite != id2unit.end(); ++ite)
+    {
+        DumpUnit* u = ite->second;
+        if (!u || dups.count(u)) continue;
+        DumpUnit*& c = canon[unit_key(ite->first)];
+        if (!c) c = u;
+        else if (c != u) dups[u] = c;
+    }
+    unit_keys = 0;
+    key_ids = 0;
+
+    for (map<int, DumpUnit*>::iterator ite = id2unit.begin();
+         ite != id2unit.end(); ++ite)
+    {
+        map<DumpUnit*, DumpUnit*>::iterator d = dups.find(ite->second);
+        if (d != dups.end()) ite->second = d->second;
+    }
+    for (map<string, DumpUnit*>::iterator ite = types.begin();
+         ite != types.end(); ++ite)
+    {
+        map<DumpUnit*, DumpUnit*>::iterator d = dups.find(ite->second);
+        if (d != dups.end()) ite->second = d->second;
+    }
+    for (map<DumpUnit*, DumpUnit*>::iterator ite = dups.begin();
+         ite != dups.end(); ++ite)
+    {
+        delete ite->first;
+    }
+    load_stats.units_merged += dups.size();
+}
+
+static Elf64_Shdr* find_section(Elf* elf, const char* name) {
+    size_t shstrndx;
+    if (elf_getshdrstrndx(elf, &shstrndx)) return 0;
+    Elf_Scn* scn = 0;
+    while ((scn = elf_nextscn(elf, scn)) != 0) {
+        Elf64_Shdr* shdr = elf64_getshdr(scn);
+        if (!shdr) continue;
+        const char* n = elf_strptr(elf, shstrndx, shdr->sh_name);
+        if (n && !strcmp(n, name)) return shdr;
+    }
+    return 0;
+}
+
+static bool is_skeleton(Dwarf_Die die, Dwarf_Half cu_type) {
+    Dwarf_Attribute attr;
+    return cu_type == DW_UT_skeleton ||
+        getTag(die) == DW_TAG_skeleton_unit ||
+        !getAttr(die, DW_AT_GNU_dwo_name, "GNU_dwo_name", &attr);
+}
+
+// Remembers where the DIEs of a skeleton CU are.  The file names are
+// copied now, as the line table stays in the executable.
+static void add_split(Dwarf_Die die, const Dwarf_Sig8& signature,
+                      int version) {
+    SplitUnit su;
+    string dwo = getAttrStr(die, DW_AT_dwo_name, "dwo_name");
+    if (dwo.empty()) dwo = getAttrStr(die, DW_AT_GNU_dwo_name, "GNU_dwo_name");
+    string dir = getAttrStr(die, DW_AT_comp_dir, "comp_dir");
+    su.dwo_path = dwo[0] == '/' || dir.empty() ? dwo : dir + "/" + dwo;
+    su.dwo_id = signature;
+    // Before DWARF 5, the id is an attribute of the skeleton.
+    Dwarf_Attribute attr;
+    Dwarf_Unsigned id;
+    Dwarf_Error err;
+    if (version < 5 &&
+        !getAttr(die, DW_AT_GNU_dwo_id, "GNU_dwo_id", &attr) &&
+        dwarf_formudata(attr, &id, &err) == DW_DLV_OK)
+    {
+        memcpy(su.dwo_id.signature, &id, sizeof(id));
+    }
+    su.low = getLowPc(die);
+    su.high = getHighPc(die, su.low);
+    su.version = version;
+
+    char** files;
+    Dwarf_Signed num;
+    if (dwarf_srcfiles(die, &files, &num, &err) == DW_DLV_OK) {
+        for (int i = 0; i < num; i++) {
+            su.srcfiles.push_back(files[i]);
+            dwarf_dealloc(dbg, files[i], DW_DLA_STRING);
+        }
+        dwarf_dealloc(dbg, files, DW_DLA_LIST);
+    }
+    // GCC names only the .dwo before DWARF 5, but the primary source is
+    // the first file of the line table.
+    su.name = getAttrStr(die, DW_AT_name, "name");
+    if (su.name.empty()) {
+        su.name = su.srcfiles.empty() ? dwo : su.srcfiles[0];
+    }
+    su.loaded = false;
+    split_units.push_back(su);
+    splits_pending++;
+    load_stats.split_units++;
+}
+
+// Reads all units of .debug_info or .debug_types, or only the type units
+// with `types_only'.  Ids are the section offsets plus `base'.
+static int open_units(Dwarf_Bool is_info, int base, bool types_only = false) {
+    Dwarf_Die die = 0;
+    Dwarf_Error err;
+    int ret;
+
+    Dwarf_Unsigned cu_header_length = 0;
+    Dwarf_Half version_stamp = 0;
+    Dwarf_Off abbrev_offset = 0;
+    Dwarf_Half address_size = 0;
+    Dwarf_Half offset_size = 0;
+    Dwarf_Half extension_size = 0;
+    Dwarf_Sig8 signature;
+    Dwarf_Unsigned type_offset = 0;
+    Dwarf_Unsigned next_cu_offset = 0;
+    Dwarf_Half cu_type = 0;
+
+    id_base = base;
+
+    while ((ret =
+            dwarf_next_cu_header_d(dbg, is_info, &cu_header_length,
+                                   &version_stamp, &abbrev_offset,
+                                   &address_size, &offset_size,
+                                   &extension_size, &signature,
+                                   &type_offset, &next_cu_offset,
+                                   &cu_type, &err))
+           == DW_DLV_OK)
+    {
+        load_stats.cus++;
+        ret = dwarf_siblingof_b(dbg, NULL, is_info, &die, &err);
+        if (ret == DW_DLV_NO_ENTRY) {
+            continue;
+        }
+        else if (ret != DW_DLV_OK) {
+            print_error("dwarf_siblingof_b", ret, err);
+            return ret;
+        }
+
+        processing_cu_version = version_stamp;
+        bool type_unit = !is_info || cu_type == DW_UT_type ||
+            cu_type == DW_UT_split_type;
+        if (types_only && !type_unit) {
+            dwarf_dealloc(dbg, die, DW_DLA_DIE);
+            continue;
+        }
+        try {
+            if (is_info && !loading_split && is_skeleton(die, cu_type)) {
+                add_split(die, signature, version_stamp);
+                dwarf_dealloc(dbg, die, DW_DLA_DIE);
+                continue;
+            }
+        }
+        catch (...) {
+            return 1;
+        }
+
+        // Type units are shared between CUs; read each signature once.
+        if (type_unit) {
+            string sig(signature.signature, sizeof(signature.signature));
+            if (sig_types.find(sig) != sig_types.end()) {
+                dwarf_dealloc(dbg, die, DW_DLA_DIE);
+                continue;
+            }
+            Dwarf_Off aoff, off;
+            if (dwarf_dieoffset(die, &aoff, &err) != DW_DLV_OK ||
+                dwarf_die_CU_offset(die, &off, &err) != DW_DLV_OK)
+            {
+                print_error("dwarf_dieoffset", DW_DLV_ERROR, err);
+                return 1;
+            }
+            sig_types[sig] = aoff - off + type_offset + id_base;
+        }
+
+        if (memory_budget && !loading_split) {
+            Dwarf_Off aoff, off;
+            if (dwarf_dieoffset(die, &aoff, &err) != DW_DLV_OK ||
+                dwarf_die_CU_offset(die, &off, &err) != DW_DLV_OK)
+            {
+                print_error("dwarf_dieoffset", DW_DLV_ERROR, err);
+                return 1;
+            }
+            UnitGroup grp;
+            grp.start = aoff - off + id_base;
+            grp.end = next_cu_offset + id_base;
+            grp.cu_die = aoff;
+            grp.is_info = is_info;
+            grp.bytes = 0;
+            grp.last_use = 0;
+            grp.resident = false;
+            grp.pinned = false;
+            loading_group = groups.size();
+            groups.push_back(grp);
+        }
+
+        // Split units use the line table of their skeleton.
+        if (!loading_split) {
+            ret = dwarf_srcfiles(die, &srcfiles, &srcnum, &err);
+            if (ret != DW_DLV_OK) {
+                srcfiles = 0;
+                srcnum = 0;
+            }
+        }
+
+        ret = open_info(die, 0);
+        if (loading_group >= 0) {
+            finish_group(loading_group);
+            loading_group = -1;
+        }
+        if (ret) return ret;
+
+        if (srcfiles && !loading_split) {
             for (int i = 0; i < srcnum; i++) {
                 dwarf_dealloc(dbg, srcfiles[i], DW_DLA_STRING);
             }
@@ -912,19 +3311,534 @@ static int open_infos() {
     }
 
     if (ret == DW_DLV_ERROR) {
-        print_error("dwarf_next_cu_header", ret, err);
+        print_error("dwarf_next_cu_header_d", ret, err);
         return ret;
     }
 
     return 0;
 }
 
+static void bind_signatures() {
+    for (map<string, int>::const_iterator ite = sig_ids.begin();
+         ite != sig_ids.end(); ++ite)
+    {
+        map<string, int>::const_iterator t = sig_types.find(ite->first);
+        if (t != sig_types.end()) sig_alias[ite->second] = t->second;
+    }
+}
+
+static int open_infos() {
+    int ret = open_units(true, 0);
+    if (ret) return ret;
+    ret = open_units(false, TYPES_ID_BASE);
+    id_base = 0;
+    if (ret) return ret;
+
+    bind_signatures();
+
+    // Merged units would be shared between groups.
+    if (!memory_budget) unify_units();
+    return 0;
+}
+
+// Ids of each split file start where those of the previous one end.
+static int alloc_split_ids(Elf* elf, const char* section) {
+    Elf64_Shdr* shdr = find_section(elf, section);
+    size_t size = shdr ? shdr->sh_size : 0;
+    if (next_split_base + size >= (size_t)TYPES_ID_BASE) {
+        fprintf(stderr, "too much split DWARF to give ids\n");
+        return -1;
+    }
+    int base = next_split_base;
+    next_split_base += size;
+    return base;
+}
+
+static void close_split_file(SplitFile* f) {
+    Dwarf_Error err;
+    if (f->dbg) dwarf_finish(f->dbg, &err);
+    if (f->elf) elf_end(f->elf);
+    close(f->fd);
+    delete f;
+}
+
+static SplitFile* open_split_file(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+    SplitFile* f = new SplitFile();
+    f->fd = fd;
+    f->elf = elf_begin(fd, ELF_C_READ, 0);
+    Dwarf_Error err;
+    int ret = DW_DLV_ERROR;
+    if (f->elf) {
+        ret = dwarf_elf_init(f->elf, DW_DLC_READ, NULL, NULL, &f->dbg, &err);
+    }
+    if (ret == DW_DLV_OK) {
+        // Addresses of split units are in .debug_addr of the executable.
+        ret = dwarf_set_tied_dbg(f->dbg, main_dbg, &err);
+        f->info_base = alloc_split_ids(f->elf, ".debug_info.dwo");
+        f->types_base = alloc_split_ids(f->elf, ".debug_types.dwo");
+    }
+    if (ret != DW_DLV_OK || f->info_base < 0 || f->types_base < 0) {
+        fprintf(stderr, "ERROR:  can't read %s\n", path.c_str());
+        close_split_file(f);
+        return 0;
+    }
+    return f;
+}
+
+// Reads the DIEs of a skeleton CU.  Split units are neither merged by
+// unify_units nor evicted with a memory budget.
+static void load_split(SplitUnit* su) {
+    if (su->loaded) return;
+    su->loaded = true;
+    double t = now_sec();
+
+    Dwarf_Debug saved_dbg = dbg;
+    int saved_base = id_base;
+    int saved_group = loading_group;
+    char** saved_files = srcfiles;
+    Dwarf_Signed saved_num = srcnum;
+    vector<char*> files;
+    for (size_t i = 0; i < su->srcfiles.size(); i++) {
+        files.push_back(const_cast<char*>(su->srcfiles[i].c_str()));
+    }
+    srcfiles = files.empty() ? 0 : &files[0];
+    srcnum = files.size();
+    loading_split = su;
+    loading_group = -1;
+
+    if (dwp_file) {
+        dbg = dwp_file->dbg;
+        // Type units in a package are shared by all its CUs.
+        if (!dwp_types_loaded) {
+            dwp_types_loaded = true;
+            open_units(true, dwp_file->info_base, true);
+            open_units(false, dwp_file->types_base, true);
+        }
+        Dwarf_Die die;
+        Dwarf_Error err;
+        int ret = dwarf_die_from_hash_signature(dbg, &su->dwo_id, "cu",
+                                                &die, &err);
+        if (ret == DW_DLV_OK) {
+            processing_cu_version = su->version;
+            id_base = dwp_file->info_base;
+            open_info(die, 0);
+        }
+        else {
+            print_error("dwarf_die_from_hash_signature", ret, err);
+        }
+    }
+    else if (SplitFile* f = open_split_file(su->dwo_path)) {
+        dbg = f->dbg;
+        if (!open_units(true, f->info_base)) {
+            open_units(false, f->types_base);
+        }
+        close_split_file(f);
+    }
+
+    dbg = saved_dbg;
+    id_base = saved_base;
+    loading_group = saved_group;
+    srcfiles = saved_files;
+    srcnum = saved_num;
+    loading_split = 0;
+    bind_signatures();
+    if (opened) build_vtable_index();
+    load_stats.split_loaded++;
+    load_stats.dwarf_walk_sec += now_sec() - t;
+    splits_pending.fetch_sub(1, memory_order_release);
+}
+
+static void load_all_splits() {
+    for (size_t i = 0; i < split_units.size(); i++) {
+        load_split(&split_units[i]);
+    }
+}
+
+// Looks up the variables of a CU, reading its split unit if needed.
+static map<string, vector<variable> >::iterator find_variables(
+    const char* file) {
+    map<string, vector<variable> >::iterator vals = variables.find(file);
+    if (vals != variables.end()) return vals;
+    for (size_t i = 0; i < split_units.size(); i++) {
+        if (split_units[i].loaded || split_units[i].name != file) continue;
+        load_split(&split_units[i]);
+        return variables.find(file);
+    }
+    return vals;
+}
+
+static string unqualify(const string& name) {
+    size_t end = name.find('<');
+    size_t colon = name.rfind("::", end);
+    if (colon == string::npos) return name;
+    return name.substr(colon + 2);
+}
+
+static string demangle(const char* name) {
+    string n = name;
+    int status;
+    char* demangled = abi::__cxa_demangle(name, 0, 0, &status);
+    if (demangled) {
+        if (status == 0) n = demangled;
+        free(demangled);
+    }
+    return n;
+}
+
+// The vptr of an object points past the offset-to-top and typeinfo
+// slots of its primary virtual table.
+static const int VTABLE_HEADER = 2 * sizeof(void*);
+
+static void load_vtables(Elf* elf) {
+    Elf_Scn* scn = 0;
+    while ((scn = elf_nextscn(elf, scn)) != 0) {
+        Elf64_Shdr* shdr = elf64_getshdr(scn);
+        if (!shdr || !shdr->sh_entsize ||
+            (shdr->sh_type != SHT_SYMTAB && shdr->sh_type != SHT_DYNSYM))
+        {
+            continue;
+        }
+        Elf_Data* data = elf_getdata(scn, 0);
+        if (!data) continue;
+        Elf64_Sym* syms = (Elf64_Sym*)data->d_buf;
+        size_t num = shdr->sh_size / shdr->sh_entsize;
+        for (size_t i = 0; i < num; i++) {
+            if (ELF64_ST_TYPE(syms[i].st_info) != STT_OBJECT ||
+                !syms[i].st_value)
+            {
+                continue;
+            }
+            const char* name = elf_strptr(elf, shdr->sh_link,
+                                          syms[i].st_name);
+            if (!name || strncmp(name, "_ZTV", 4)) continue;
+            string n = demangle(name);
+            static const string prefix = "vtable for ";
+            if (n.compare(0, prefix.size(), prefix)) continue;
+            vtable v;
+            v.name = unqualify(n.substr(prefix.size()));
+            v.addr = (char*)(syms[i].st_value + base_addr) + VTABLE_HEADER;
+            vtables.push_back(v);
+        }
+    }
+}
+
+static int unit_kind(DumpUnit* u) {
+    if (dynamic_cast<DumpPrim*>(u)) return DUMP_KIND_PRIM;
+    if (dynamic_cast<DumpStruct*>(u)) return DUMP_KIND_STRUCT;
+    if (dynamic_cast<DumpPtr*>(u)) return DUMP_KIND_PTR;
+    if (dynamic_cast<DumpCv*>(u)) return DUMP_KIND_CV;
+    if (dynamic_cast<DumpTypedef*>(u)) return DUMP_KIND_TYPEDEF;
+    if (dynamic_cast<DumpFunc*>(u)) return DUMP_KIND_FUNC;
+    if (dynamic_cast<DumpArray*>(u)) return DUMP_KIND_ARRAY;
+    return DUMP_KIND_ENUM;
+}
+
+// Checks every reference between the tables of `r', whose sizes are
+// already checked against the section, so read_index can trust them.
+static bool check_index(const IndexReader& r) {
+    size_t nstr = r.count(IDX_STRINGS);
+    if (nstr && r.table<char>(IDX_STRINGS)[nstr - 1]) return false;
+
+    const IndexUnit* recs = r.table<IndexUnit>(IDX_UNITS);
+    for (size_t i = 0; i < r.count(IDX_UNITS); i++) {
+        const IndexUnit& rec = recs[i];
+        switch (rec.kind) {
+        case DUMP_KIND_STRUCT: {
+            if (!r.has_str(rec.name) ||
+                !r.has_range(IDX_MEMBERS, rec.first, rec.count))
+            {
+                return false;
+            }
+            const IndexMember* mems = r.table<IndexMember>(IDX_MEMBERS);
+            for (uint32_t j = rec.first; j < rec.first + rec.count; j++) {
+                if (!r.has_str(mems[j].name)) return false;
+                if (mems[j].loc == LOC_EXPR &&
+                    !r.has_range(IDX_EXPRS, mems[j].expr_first,
+                                 mems[j].expr_count))
+                {
+                    return false;
+                }
+            }
+            break;
+        }
+        case DUMP_KIND_ENUM: {
+            if (!r.has_str(rec.name) ||
+                !r.has_range(IDX_ENUMS, rec.first, rec.count))
+            {
+                return false;
+            }
+            const IndexEnum* enums = r.table<IndexEnum>(IDX_ENUMS);
+            for (uint32_t j = rec.first; j < rec.first + rec.count; j++) {
+                if (!r.has_str(enums[j].name)) return false;
+            }
+            break;
+        }
+        case DUMP_KIND_FUNC:
+            if (!r.has_range(IDX_ARGS, rec.first, rec.count)) return false;
+            break;
+        case DUMP_KIND_PRIM:
+        case DUMP_KIND_TYPEDEF:
+            if (!r.has_str(rec.name)) return false;
+            break;
+        case DUMP_KIND_PTR:
+        case DUMP_KIND_CV:
+        case DUMP_KIND_ARRAY:
+            break;
+        default:
+            return false;
+        }
+    }
+
+    size_t nunits = r.count(IDX_UNITS);
+    const IndexPair* pairs = r.table<IndexPair>(IDX_IDS);
+    for (size_t i = 0; i < r.count(IDX_IDS); i++) {
+        if ((uint32_t)pairs[i].value >= nunits) return false;
+    }
+    pairs = r.table<IndexPair>(IDX_TYPES);
+    for (size_t i = 0; i < r.count(IDX_TYPES); i++) {
+        if (!r.has_str(pairs[i].key) || (uint32_t)pairs[i].value >= nunits) {
+            return false;
+        }
+    }
+
+    const IndexVar* vars = r.table<IndexVar>(IDX_VARS);
+    for (size_t i = 0; i < r.count(IDX_VARS); i++) {
+        if (!r.has_str(vars[i].cu) || !r.has_str(vars[i].name) ||
+            !r.has_str(vars[i].file))
+        {
+            return false;
+        }
+    }
+    const IndexFunc* fs = r.table<IndexFunc>(IDX_FUNCS);
+    for (size_t i = 0; i < r.count(IDX_FUNCS); i++) {
+        if (!r.has_str(fs[i].name) ||
+            !r.has_range(IDX_LOCS, fs[i].frame_first, fs[i].frame_count) ||
+            !r.has_range(IDX_LOCALS, fs[i].local_first, fs[i].local_count))
+        {
+            return false;
+        }
+    }
+    const IndexLocal* locals = r.table<IndexLocal>(IDX_LOCALS);
+    for (size_t i = 0; i < r.count(IDX_LOCALS); i++) {
+        if (!r.has_str(locals[i].name) ||
+            !r.has_range(IDX_LOCS, locals[i].loc_first, locals[i].loc_count))
+        {
+            return false;
+        }
+    }
+    const IndexLoc* locs = r.table<IndexLoc>(IDX_LOCS);
+    for (size_t i = 0; i < r.count(IDX_LOCS); i++) {
+        if (!r.has_range(IDX_EXPRS, locs[i].expr_first, locs[i].expr_count)) {
+            return false;
+        }
+    }
+    const IndexGlobal* globs = r.table<IndexGlobal>(IDX_GLOBALS);
+    for (size_t i = 0; i < r.count(IDX_GLOBALS); i++) {
+        if (!r.has_str(globs[i].name)) return false;
+    }
+    const IndexAddr* addrs = r.table<IndexAddr>(IDX_VTABLES);
+    for (size_t i = 0; i < r.count(IDX_VTABLES); i++) {
+        if (!r.has_str(addrs[i].name)) return false;
+    }
+    return true;
+}
+
+// Location lists are kept relocated except for the one which is valid
+// everywhere.
+static bool location_everywhere(const location& l) {
+    return l.low == 0 && l.high == (Dwarf_Addr)-1;
+}
+
+static vector<location> read_locations(const IndexReader& r,
+                                       uint32_t first, uint32_t count)
+{
+    const IndexLoc* locs = r.table<IndexLoc>(IDX_LOCS);
+    const IndexOp* ops = r.table<IndexOp>(IDX_EXPRS);
+    vector<location> ret(count);
+    for (uint32_t i = 0; i < count; i++) {
+        const IndexLoc& il = locs[first + i];
+        location& l = ret[i];
+        l.low = il.low;
+        l.high = il.high;
+        if (!location_everywhere(l)) {
+            l.low += base_addr;
+            l.high += base_addr;
+        }
+        l.ops.resize(il.expr_count);
+        for (uint32_t j = 0; j < il.expr_count; j++) {
+            memset(&l.ops[j], 0, sizeof(l.ops[j]));
+            l.ops[j].lr_atom = ops[il.expr_first + j].atom;
+            l.ops[j].lr_number = ops[il.expr_first + j].number;
+        }
+    }
+    return ret;
+}
+
+static void save_locations(IndexWriter* w, const vector<location>& locs,
+                           uint32_t* first, uint32_t* count)
+{
+    *first = w->locs.size();
+    *count = locs.size();
+    for (size_t i = 0; i < locs.size(); i++) {
+        const location& l = locs[i];
+        IndexLoc il;
+        il.low = l.low;
+        il.high = l.high;
+        if (!location_everywhere(l)) {
+            il.low -= base_addr;
+            il.high -= base_addr;
+        }
+        il.expr_first = w->exprs.size();
+        il.expr_count = l.ops.size();
+        for (size_t j = 0; j < l.ops.size(); j++) {
+            IndexOp op = { l.ops[j].lr_atom, 0, l.ops[j].lr_number };
+            w->exprs.push_back(op);
+        }
+        w->locs.push_back(il);
+    }
+}
+
+static void read_index(const IndexReader& r) {
+    vector<DumpUnit*> units;
+    const IndexUnit* recs = r.table<IndexUnit>(IDX_UNITS);
+    for (size_t i = 0; i < r.count(IDX_UNITS); i++) {
+        const IndexUnit& rec = recs[i];
+        DumpUnit* u;
+        switch (rec.kind) {
+        case DUMP_KIND_PRIM: u = new DumpPrim(r, rec); break;
+        case DUMP_KIND_STRUCT: u = new DumpStruct(r, rec); break;
+        case DUMP_KIND_PTR: u = new DumpPtr(r, rec); break;
+        case DUMP_KIND_CV: u = new DumpCv(r, rec); break;
+        case DUMP_KIND_TYPEDEF: u = new DumpTypedef(r, rec); break;
+        case DUMP_KIND_FUNC: u = new DumpFunc(r, rec); break;
+        case DUMP_KIND_ARRAY: u = new DumpArray(r, rec); break;
+        default: u = new DumpEnum(r, rec); break;
+        }
+        u->id = rec.id;
+        units.push_back(u);
+        load_stats.units[unit_kind(u)]++;
+    }
+
+    const IndexPair* pairs = r.table<IndexPair>(IDX_IDS);
+    for (size_t i = 0; i < r.count(IDX_IDS); i++) {
+        id2unit[pairs[i].key] = units[pairs[i].value];
+    }
+    pairs = r.table<IndexPair>(IDX_ALIASES);
+    for (size_t i = 0; i < r.count(IDX_ALIASES); i++) {
+        sig_alias[pairs[i].key] = pairs[i].value;
+    }
+    pairs = r.table<IndexPair>(IDX_TYPES);
+    for (size_t i = 0; i < r.count(IDX_TYPES); i++) {
+        types[r.str(pairs[i].key)] = units[pairs[i].value];
+    }
+
+    const IndexVar* vars = r.table<IndexVar>(IDX_VARS);
+    for (size_t i = 0; i < r.count(IDX_VARS); i++) {
+        variable v;
+        v.name = r.str(vars[i].name);
+        v.file = r.str(vars[i].file);
+        v.line = vars[i].line;
+        v.type = vars[i].type;
+        variables[r.str(vars[i].cu)].push_back(v);
+    }
+
+    const IndexFunc* fs = r.table<IndexFunc>(IDX_FUNCS);
+    const IndexLocal* locals = r.table<IndexLocal>(IDX_LOCALS);
+    for (size_t i = 0; i < r.count(IDX_FUNCS); i++) {
+        func f;
+        f.name = r.str(fs[i].name);
+        f.low = (void*)(fs[i].low + base_addr);
+        f.high = (void*)(fs[i].high + base_addr);
+        f.frame_base = read_locations(r, fs[i].frame_first,
+                                      fs[i].frame_count);
+        for (uint32_t j = 0; j < fs[i].local_count; j++) {
+            const IndexLocal& il = locals[fs[i].local_first + j];
+            local l;
+            l.name = r.str(il.name);
+            l.type = il.type;
+            l.param = il.param;
+            l.low = il.low ? (void*)(il.low + base_addr) : 0;
+            l.high = il.low ? (void*)(il.high + base_addr) : 0;
+            l.loc = read_locations(r, il.loc_first, il.loc_count);
+            f.locals.push_back(l);
+        }
+        funcs.push_back(f);
+    }
+
+    const IndexGlobal* globs = r.table<IndexGlobal>(IDX_GLOBALS);
+    for (size_t i = 0; i < r.count(IDX_GLOBALS); i++) {
+        global g;
+        g.addr = (void*)(globs[i].addr + base_addr);
+        g.type = globs[i].type;
+        globals.insert(make_pair(string(r.str(globs[i].name)), g));
+    }
+
+    const IndexAddr* addrs = r.table<IndexAddr>(IDX_VTABLES);
+    for (size_t i = 0; i < r.count(IDX_VTABLES); i++) {
+        vtable v;
+        v.name = r.str(addrs[i].name);
+        v.addr = (void*)(addrs[i].low + base_addr);
+        vtables.push_back(v);
+    }
+}
+
+// Loads the registry from the index section if `elf' has one.  The
+// section is mapped from the file rather than read through libelf.
+static bool load_index(Elf* elf, const char* file_name) {
+    Elf64_Shdr* shdr = find_section(elf, INDEX_SECTION);
+    if (!shdr || shdr->sh_size < sizeof(IndexHeader)) return false;
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) return false;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t skew = shdr->sh_offset % page;
+    size_t len = shdr->sh_size + skew;
+    char* map = (char*)mmap(0, len, PROT_READ, MAP_PRIVATE, fd,
+                            shdr->sh_offset - skew);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const IndexHeader* h = (const IndexHeader*)(map + skew);
+    bool ok = !memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) &&
+        h->version == INDEX_VERSION && h->pointer_size == sizeof(void*);
+    static const size_t entry_sizes[IDX_NUM] = {
+        sizeof(IndexUnit), sizeof(IndexPair), sizeof(IndexPair),
+        sizeof(IndexPair), sizeof(IndexMember), sizeof(IndexEnum),
+        sizeof(int32_t), sizeof(IndexVar), sizeof(IndexFunc),
+        sizeof(IndexAddr), sizeof(IndexOp), sizeof(IndexLocal),
+        sizeof(IndexLoc), sizeof(IndexGlobal), 1
+    };
+    for (int t = 0; ok && t < IDX_NUM; t++) {
+        ok = h->offsets[t] <= shdr->sh_size &&
+            h->counts[t] <= (shdr->sh_size - h->offsets[t]) / entry_sizes[t];
+    }
+    // A bad reference anywhere rejects the whole index.
+    ok = ok && check_index(IndexReader(map + skew));
+    if (ok) {
+        read_index(IndexReader(map + skew));
+    }
+    else {
+        fprintf(stderr, "ignoring a broken or old %s in %s\n",
+                INDEX_SECTION, file_name);
+    }
+    munmap(map, len);
+    return ok;
+}
+
 static int process_one_file(Elf* elf, const char* file_name, int archive) {
     int dres;
     Dwarf_Error err;
     int ret;
+    double t;
+
+    // Section offsets of archive members are not file offsets.
+    if (!archive && !memory_budget && load_index(elf, file_name)) return 0;
 
+    t = now_sec();
     dres = dwarf_elf_init(elf, DW_DLC_READ, NULL, NULL, &dbg, &err);
+    load_stats.dwarf_init_sec += now_sec() - t;
     if (dres == DW_DLV_NO_ENTRY) {
         printf("No DWARF information present in %s\n", file_name);
         return 0;
@@ -941,18 +3855,63 @@ static int process_one_file(Elf* elf, const char* file_name, int archive) {
                mem_header ? mem_header->ar_name : "");
     }
 
+    load_vtables(elf);
+
 //    print_infos();
+    t = now_sec();
+    main_dbg = dbg;
     ret = open_infos();
+    load_stats.dwarf_walk_sec += now_sec() - t;
+
+    if (!split_units.empty() && !dwp_file) {
+        Elf64_Shdr* info = find_section(elf, ".debug_info");
+        next_split_base = info ? info->sh_size : 0;
+        // A package made by dwp has the DIEs of all skeletons.
+        dwp_file = open_split_file(string(file_name) + ".dwp");
+    }
 
     return ret;
 }
 
+static size_t registry_bytes() {
+    size_t size = 0;
+    for (map<string, DumpUnit*>::const_iterator ite = types.begin();
+         ite != types.end(); ++ite)
+    {
+        size += MAP_NODE_SIZE + sizeof(*ite) + heap_size(ite->first);
+    }
+    for (map<int, DumpUnit*>::const_iterator ite = id2unit.begin();
+         ite != id2unit.end(); ++ite)
+    {
+        size += MAP_NODE_SIZE + sizeof(*ite);
+        if (ite->second) size += ite->second->memory();
+    }
+    for (map<string, vector<variable> >::const_iterator ite =
+             variables.begin(); ite != variables.end(); ++ite)
+    {
+        size += MAP_NODE_SIZE + sizeof(*ite) + heap_size(ite->first);
+        size += ite->second.capacity() * sizeof(variable);
+    }
+    for (map<string, global>::const_iterator ite = globals.begin();
+         ite != globals.end(); ++ite)
+    {
+        size += MAP_NODE_SIZE + sizeof(*ite) + heap_size(ite->first);
+    }
+    size += funcs.capacity() * sizeof(func);
+    for (size_t i = 0; i < funcs.size(); i++) {
+        size += funcs[i].locals.capacity() * sizeof(local);
+        size += funcs[i].frame_base.capacity() * sizeof(location);
+    }
+    return size;
+}
+
 extern "C" int dump_open(const char* file_name, void* ba) {
     int f;
     Elf_Cmd cmd;
     Elf *arf, *elf;
     int archive = 0;
     int ret = 0;
+    double start = now_sec();
 
     base_addr = (Dwarf_Addr)ba;
 
@@ -1001,54 +3960,3386 @@ extern "C" int dump_open(const char* file_name, void* ba) {
         cmd = elf_next(elf);
         elf_end(elf);
     }
-    elf_end(arf);
+    // libdwarf reads sections on demand, so units read later need the ELF.
+    if (!memory_budget && split_units.empty()) elf_end(arf);
+    load_stats.open_sec += now_sec() - start;
+    load_stats.registry_bytes = registry_bytes();
+    opened = true;
+    build_vtable_index();
+    enforce_budget();
     return ret;
 }
 
 extern "C" void dump(void* p, const char* type) {
+    RegistryLock reg;
     disp_ptrs.clear();
 //    disp_ptrs.insert(p);
 
-    string name(type);
-    map<string, DumpUnit*>::iterator ite = types.find(name);
-    if (ite != types.end()) {
-        ite->second->dump(p);
+    tstats().dump_calls.add(1);
+
+    DumpUnit* u = find_type(type);
+    if (u) {
+        u->dump(p);
+    }
+    else {
+        tstats().lookup_misses.add(1);
     }
-    printf("\n");
+    emit("\n");
+    enforce_budget();
 }
 
-extern "C" void dump_s(void* p, const char* name, const char* file, int line) {
-    disp_ptrs.clear();
-//    disp_ptrs.insert(p);
-
-    map<string, vector<variable> >::iterator vals = variables.find(file);
-    if (vals == variables.end()) {
-        printf("cannot find debug_info of %s\n", file);
-        return;
-    }
-
+// The type of the temporary which p() declared at file:line, or -1.
+static int site_type(const vector<variable>& vals, const char* file,
+                     int line)
+{
     int type = -1;
-    for (vector<variable>::iterator ite = vals->second.begin();
-         ite != vals->second.end(); ++ite)
+    for (vector<variable>::const_iterator ite = vals.begin();
+         ite != vals.end(); ++ite)
     {
         if (ite->file.find(file) != string::npos && ite->line > line) continue;
         if (ite->name == "dump_vp_") {
             type = ite->type;
         }
     }
+    return type;
+}
+
+static atomic<bool> aggregating;
+static void aggregate_s(void* p, const char* name, const char* file,
+                        int line);
+struct LogHeader;
+static atomic<LogHeader*> log_header;
+static void log_s(LogHeader* h, void* p, const char* name, const char* file,
+                  int line);
+
+extern "C" void dump_s(void* p, const char* name, const char* file, int line) {
+    ThreadStats& ts = tstats();
+    ts.dump_s_calls.add(1);
+    if (aggregating.load(memory_order_relaxed)) {
+        aggregate_s(p, name, file, line);
+        return;
+    }
+    if (LogHeader* h = log_header.load(memory_order_acquire)) {
+        log_s(h, p, name, file, line);
+        return;
+    }
+
+    RegistryLock reg;
+    disp_ptrs.clear();
+//    disp_ptrs.insert(p);
+
+    ts.addSite(file, line);
+
+    map<string, vector<variable> >::iterator vals = find_variables(file);
+    if (vals == variables.end()) {
+        ts.lookup_misses.add(1);
+        emit("cannot find debug_info of %s\n", file);
+        return;
+    }
 
+    int type = site_type(vals->second, file, line);
     if (type == -1) {
-        printf("cannot find type of %s\n", name);
+        ts.lookup_misses.add(1);
+        emit("cannot find type of %s\n", name);
         return;
     }
 
-    DumpUnit* u = id2unit[type];
+    DumpUnit* u = find_unit(type);
     if (!u) {
-        printf("cannot find type info of %s\n", name);
+        ts.lookup_misses.add(1);
+        emit("cannot find type info of %s\n", name);
         return;
     }
 
-    printf("%s = ", name);
+    emit("%s = ", name);
     u->dump(p);
-    printf(" : %s\n", u->name().c_str());
+    emit(" : %s\n", u->name().c_str());
+    enforce_budget();
+}
+
+extern "C" void dump_stats(dump_stats_t* st) {
+    RegistryLock reg;
+    *st = load_stats;
+    st->memory_budget = memory_budget;
+    st->resident_bytes = memory_budget ? resident_bytes : st->registry_bytes;
+    st->groups = groups.size();
+
+    lock_guard<mutex> lock(stats_mu);
+    st->dump_calls += retired_stats.dump_calls;
+    st->dump_s_calls += retired_stats.dump_s_calls;
+    st->lookup_misses += retired_stats.lookup_misses;
+    st->unreadable_ptrs += retired_stats.unreadable_ptrs;
+    st->bytes_emitted += retired_stats.bytes_emitted;
+    st->registry_hits += retired_stats.registry_hits;
+    st->registry_loads += retired_stats.registry_loads;
+    st->registry_evictions += retired_stats.registry_evictions;
+    for (set<ThreadStats*>::const_iterator ite = live_stats.begin();
+         ite != live_stats.end(); ++ite)
+    {
+        add_thread_stats(*ite, st, NULL);
+    }
+}
+
+extern "C" void dump_stats_sites(dump_site_func fn, void* arg) {
+    SiteCounts sites;
+    {
+        lock_guard<mutex> lock(stats_mu);
+        sites = retired_sites;
+        for (set<ThreadStats*>::const_iterator ite = live_stats.begin();
+             ite != live_stats.end(); ++ite)
+        {
+            lock_guard<mutex> sites_lock((*ite)->sites_mu);
+            add_thread_stats(*ite, NULL, &sites);
+        }
+    }
+    for (SiteCounts::const_iterator ite = sites.begin();
+         ite != sites.end(); ++ite)
+    {
+        fn(ite->first.first.c_str(), ite->first.second, ite->second, arg);
+    }
+}
+
+// Turns a typeid name into the DW_AT_name of the type.  DWARF names are
+// not qualified, while template arguments keep their qualifiers.
+static string dwarf_type_name(const char* name) {
+    string n = unqualify(demangle(name));
+
+    // GCC spells some base types differently.
+    static const char* base_names[][2] = {
+        { "short", "short int" },
+        { "unsigned short", "short unsigned int" },
+        { "long", "long int" },
+        { "unsigned long", "long unsigned int" },
+        { "long long", "long long int" },
+        { "unsigned long long", "long long unsigned int" },
+    };
+    for (size_t i = 0; i < sizeof(base_names) / sizeof(base_names[0]); i++) {
+        if (n == base_names[i][0]) return base_names[i][1];
+    }
+    return n;
+}
+
+extern "C" void* dump_type_handle(const char* name) {
+    RegistryLock reg;
+    DumpUnit* u = find_type(name);
+    if (!u) u = find_type(dwarf_type_name(name));
+    if (!u) {
+        tstats().lookup_misses.add(1);
+        return 0;
+    }
+    // Handles are cached by callers, so they must never be evicted.
+    pin_unit(u);
+    return u;
+}
+
+extern "C" void dump_unit(void* p, void* handle, const char* label) {
+    RegistryLock reg;
+    disp_ptrs.clear();
+    tstats().dump_calls.add(1);
+
+    DumpUnit* u = (DumpUnit*)handle;
+    if (!u) {
+        emit("cannot find type info of %s\n", label ? label : "value");
+        return;
+    }
+    if (label) emit("%s = ", label);
+    if (!is_readable_range(p, u->size())) {
+        emit("%p <invalid ptr>", p);
+    }
+    else {
+        u->dump(p);
+    }
+    emit(" : %s\n", u->name().c_str());
+    enforce_budget();
+}
+
+extern "C" int dump_register_formatter(const char* type,
+                                       dump_formatter_fn fn, void* arg) {
+    if (!type || !fn) return 1;
+    // Dumps read formatters without a lock, so they are fixed once the
+    // registry is open.  Units look them up as they are built.
+    if (opened) {
+        fprintf(stderr, "formatter for %s must be registered before "
+                "dump_open\n", type);
+        return 1;
+    }
+    Formatter& f = formatters()[type];
+    f.fn = fn;
+    f.arg = arg;
+    return 0;
+}
+
+extern "C" int dump_format(const void* p, const char* type) {
+    const Formatter* f = find_formatter(type);
+    if (!f) return 0;
+    f->fn(p, f->arg);
+    return 1;
+}
+
+extern "C" int dump_printf(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vemit(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+extern "C" void dump_layout(const char* type) {
+    RegistryLock reg;
+    DumpStruct* st = dynamic_cast<DumpStruct*>(strip_unit(find_type(type)));
+    if (!st) {
+        tstats().lookup_misses.add(1);
+        emit("cannot find struct %s\n", type);
+        return;
+    }
+    st->layout(true);
+    enforce_budget();
+}
+
+// A compiled path is a chain of pointer loads with constant offsets in
+// between, so dumping a leaf never looks at names.
+struct PathLeaf {
+    string label;
+    // Offsets to add before each pointer load.
+    vector<int> derefs;
+    int offset;
+    DumpUnit* unit;
+    // The member if it is a bitfield.
+    DumpStruct::Member bitfield;
+    string error;
+};
+
+// Entries are never removed, so they stay valid after paths_mu is
+// released.
+static mutex paths_mu;
+static map<pair<string, string>, vector<PathLeaf> > compiled_paths;
+
+// Finds a member, looking into base classes too.
+static const DumpStruct::Member* find_member(DumpStruct* st,
+                                             const string& name, int* loc)
+{
+    const vector<DumpStruct::Member>& mems = st->members();
+    for (size_t i = 0; i < mems.size(); i++) {
+        if (mems[i].name == name && mems[i].loc >= 0) {
+            *loc = mems[i].loc;
+            return &mems[i];
+        }
+    }
+    for (size_t i = 0; i < mems.size(); i++) {
+        // Virtual bases have no fixed offset.
+        if (mems[i].name != "<inherit>" || mems[i].loc < 0) continue;
+        DumpStruct* base =
+            dynamic_cast<DumpStruct*>(strip_unit(find_unit(mems[i].type)));
+        int base_loc;
+        const DumpStruct::Member* mem;
+        if (base && (mem = find_member(base, name, &base_loc))) {
+            *loc = mems[i].loc + base_loc;
+            return mem;
+        }
+    }
+    return 0;
+}
+
+static string compile_path(DumpUnit* root, const string& path,
+                           PathLeaf* leaf)
+{
+    leaf->label = path;
+    leaf->offset = 0;
+    leaf->unit = 0;
+    leaf->bitfield.bits = 0;
+    DumpUnit* u = root;
+    size_t i = 0;
+    while (i < path.size()) {
+        DumpUnit* t = strip_unit(u);
+        if (path[i] == '[') {
+            char* end;
+            long n = strtol(path.c_str() + i + 1, &end, 10);
+            if (*end != ']') return "bad index";
+            i = end + 1 - path.c_str();
+            int elem_type;
+            if (DumpArray* a = dynamic_cast<DumpArray*>(t)) {
+                elem_type = a->type();
+            }
+            else if (DumpPtr* ptr = dynamic_cast<DumpPtr*>(t)) {
+                leaf->derefs.push_back(leaf->offset);
+                leaf->offset = 0;
+                elem_type = ptr->type();
+            }
+            else {
+                return "not an array or pointer";
+            }
+            u = find_unit(elem_type);
+            if (!u || u->size() < 0) return "unknown element size";
+            leaf->offset += n * u->size();
+            continue;
+        }
+
+        if (path.compare(i, 2, "->") == 0) {
+            DumpPtr* ptr = dynamic_cast<DumpPtr*>(t);
+            if (!ptr) return "not a pointer";
+            leaf->derefs.push_back(leaf->offset);
+            leaf->offset = 0;
+            t = strip_unit(find_unit(ptr->type()));
+            i += 2;
+        }
+        else if (path[i] == '.') {
+            i++;
+        }
+        else if (i != 0) {
+            return "unexpected character";
+        }
+
+        size_t b = i;
+        while (i < path.size() && (isalnum(path[i]) || path[i] == '_')) i++;
+        if (b == i) return "member name expected";
+        DumpStruct* st = dynamic_cast<DumpStruct*>(t);
+        if (!st) return "not a struct";
+        int loc;
+        const DumpStruct::Member* mem = find_member(st, path.substr(b, i - b),
+                                                    &loc);
+        if (!mem) return "no member " + path.substr(b, i - b);
+        leaf->offset += loc;
+        if (mem->bits) leaf->bitfield = *mem;
+        u = find_unit(mem->type);
+        if (!u) return "unknown type";
+    }
+    leaf->unit = u;
+    pin_unit(u);
+    return "";
+}
+
+// Compiles comma separated paths.
+static void compile_paths(DumpUnit* root, const char* paths,
+                          vector<PathLeaf>* leaves) {
+    string all(paths);
+    size_t b = 0;
+    while (b <= all.size()) {
+        size_t e = all.find(',', b);
+        if (e == string::npos) e = all.size();
+        string path = all.substr(b, e - b);
+        path.erase(remove(path.begin(), path.end(), ' '), path.end());
+        if (!path.empty()) {
+            leaves->push_back(PathLeaf());
+            leaves->back().error = compile_path(root, path, &leaves->back());
+        }
+        b = e + 1;
+    }
+}
+
+static vector<PathLeaf>* get_compiled_paths(const char* type,
+                                            const char* paths)
+{
+    lock_guard<mutex> lock(paths_mu);
+    pair<string, string> key(type, paths);
+    map<pair<string, string>, vector<PathLeaf> >::iterator ite =
+        compiled_paths.find(key);
+    if (ite != compiled_paths.end()) return &ite->second;
+
+    DumpUnit* root = find_type(type);
+    if (!root) return 0;
+    pin_unit(root);
+    vector<PathLeaf>& leaves = compiled_paths[key];
+    compile_paths(root, paths, &leaves);
+    return &leaves;
+}
+
+static void dump_leaves(void* p, const vector<PathLeaf>& leaves) {
+    for (size_t i = 0; i < leaves.size(); i++) {
+        const PathLeaf& leaf = leaves[i];
+        emit("%s = ", leaf.label.c_str());
+        if (!leaf.unit) {
+            emit("<%s>\n", leaf.error.c_str());
+            continue;
+        }
+        char* addr = (char*)p;
+        size_t d;
+        for (d = 0; d < leaf.derefs.size(); d++) {
+            addr += leaf.derefs[d];
+            if (read_bounded(&addr, addr, sizeof(addr)) != sizeof(addr)) {
+                break;
+            }
+        }
+        addr += leaf.offset;
+        char* val = 0;
+        if (d == leaf.derefs.size()) {
+            int size = leaf.bitfield.bits ? leaf.bitfield.unit :
+                max(leaf.unit->size(), 1);
+            if (mem_image) val = (char*)mem_image->find(addr, size);
+            else if (is_readable_range(addr, size)) val = addr;
+        }
+        if (!val) {
+            tstats().unreadable_ptrs.add(1);
+            emit("%p <invalid ptr>", addr);
+        }
+        else if (leaf.bitfield.bits) {
+            DumpStruct::dumpBits(leaf.bitfield, val, leaf.unit);
+        }
+        else {
+            leaf.unit->dump(val);
+        }
+        emit(" : %s", leaf.unit->name().c_str());
+        if (leaf.bitfield.bits) emit(":%d", leaf.bitfield.bits);
+        emit("\n");
+    }
+}
+
+extern "C" void dump_path(void* p, const char* type, const char* paths) {
+    RegistryLock reg;
+    disp_ptrs.clear();
+    tstats().dump_calls.add(1);
+
+    vector<PathLeaf>* leaves = get_compiled_paths(type, paths);
+    if (!leaves) {
+        tstats().lookup_misses.add(1);
+        emit("cannot find type info of %s\n", type);
+        return;
+    }
+    dump_leaves(p, *leaves);
+    enforce_budget();
+}
+
+extern "C" void dump_layout_summary(int top) {
+    RegistryLock reg;
+    vector<pair<int, DumpStruct*> > wasted;
+    long long total_size = 0, total_holes = 0, total_padding = 0;
+    int total_straddles = 0;
+    for (map<string, DumpUnit*>::iterator ite = types.begin();
+         ite != types.end(); ++ite)
+    {
+        DumpStruct* st = dynamic_cast<DumpStruct*>(ite->second);
+        if (!st || st->size() <= 0) continue;
+        DumpStruct::Layout l = st->layout(false);
+        total_size += l.size;
+        total_holes += l.sum_holes;
+        total_padding += l.padding;
+        total_straddles += l.straddles;
+        if (l.sum_holes + l.padding > 0) {
+            wasted.push_back(make_pair(l.sum_holes + l.padding, st));
+        }
+    }
+    sort(wasted.rbegin(), wasted.rend());
+
+    emit("/* types: %d wasting bytes, total size: %lld, "
+         "holes: %lld, padding: %lld, straddles: %d */\n",
+         (int)wasted.size(), total_size, total_holes, total_padding,
+         total_straddles);
+    for (int i = 0; i < (int)wasted.size() && (top <= 0 || i < top); i++) {
+        emit("%8d %s\n", wasted[i].first, wasted[i].second->name().c_str());
+    }
+}
+
+// Introspection endpoint: a thread answers one query per line on a Unix
+// socket with the registry loaded by dump_open.  Clients are served one
+// at a time, and each answer is cut at SERVE_BYTES_MAX bytes or after
+// SERVE_SEC_MAX seconds, so a query costs at most one low-priority core
+// for a bounded time.  Answers end with a line of a single ".".
+
+static const size_t SERVE_LINE_MAX = 1024;
+static const size_t SERVE_BYTES_MAX = 1 << 20;
+static const double SERVE_SEC_MAX = 0.1;
+static const int SERVE_TYPES_MAX = 1000;
+
+static thread* serve_thread;
+static int serve_fd = -1;
+static string serve_path;
+static atomic<bool> serve_stop;
+
+static void serve_query(const string& cmd, const string& arg) {
+    RegistryLock reg;
+    if (cmd == "dump" || cmd == "path") {
+        size_t sp = arg.find(' ');
+        string name = arg.substr(0, sp);
+        map<string, global>::const_iterator g = globals.find(name);
+        DumpUnit* u = g != globals.end() ? find_unit(g->second.type) : 0;
+        if (!u) {
+            emit("cannot find global %s\n", name.c_str());
+            return;
+        }
+        disp_ptrs.clear();
+        // Other threads may free or unmap what is dumped, so it is
+        // copied with read_bounded first.
+        MemImage image;
+        image.live = true;
+        ImageScope scope(&image);
+        if (cmd == "path") {
+            vector<PathLeaf> leaves;
+            compile_paths(u, sp == string::npos ? "" : arg.c_str() + sp + 1,
+                          &leaves);
+            dump_leaves(g->second.addr, leaves);
+            return;
+        }
+        emit("%s = ", name.c_str());
+        void* copy = image.find(g->second.addr, max(u->size(), 1));
+        if (copy) u->dump(copy);
+        else emit("%p <invalid ptr>", g->second.addr);
+        emit(" : %s\n", u->name().c_str());
+    }
+    else if (cmd == "types") {
+        int n = 0;
+        for (map<string, DumpUnit*>::const_iterator ite = types.begin();
+             ite != types.end(); ++ite)
+        {
+            if (fnmatch(arg.c_str(), ite->first.c_str(), 0)) continue;
+            if (n++ == SERVE_TYPES_MAX) {
+                emit("...\n");
+                break;
+            }
+            emit("%s\n", ite->first.c_str());
+        }
+    }
+    else if (cmd == "layout") {
+        DumpStruct* st = dynamic_cast<DumpStruct*>(strip_unit(find_type(arg)));
+        if (st) st->layout(true);
+        else emit("cannot find struct %s\n", arg.c_str());
+    }
+    else {
+        emit("dump <global> | path <global> <paths> | types <glob> | "
+             "layout <type>\n");
+    }
+}
+
+static void serve_client(int fd) {
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    string in;
+    while (!serve_stop) {
+        size_t nl;
+        while ((nl = in.find('\n')) == string::npos) {
+            char buf[256];
+            if (in.size() > SERVE_LINE_MAX) return;
+            ssize_t r = recv(fd, buf, sizeof(buf), 0);
+            if (r < 0 && errno == EINTR) continue;
+            // Idle clients are dropped after the timeout.
+            if (r <= 0) return;
+            in.append(buf, r);
+        }
+        string line = in.substr(0, nl);
+        in.erase(0, nl + 1);
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        size_t b = line.find_first_not_of(' ');
+        if (b == string::npos) b = line.size();
+        size_t e = line.find(' ', b);
+        string cmd = line.substr(b, e - b);
+        size_t a = e == string::npos ? e : line.find_first_not_of(' ', e);
+        string arg = a == string::npos ? "" : line.substr(a);
+
+        string out;
+        EmitStream st = { fd, 0, SERVE_BYTES_MAX, now_sec() + SERVE_SEC_MAX,
+                          0 };
+        emit_buf = &out;
+        emit_stream = &st;
+        bool cut = false;
+        try {
+            serve_query(cmd, arg);
+            flush_stream();
+        }
+        catch (const EmitLimit&) {
+            cut = true;
+            nest_level = 0;
+        }
+        emit_stream = 0;
+        emit_buf = 0;
+        const char* end = cut ? "\n... (cut)\n.\n" : ".\n";
+        if (!send_all(fd, end, strlen(end))) return;
+    }
+}
+
+static void serve_main(int lfd) {
+#ifdef __linux__
+    // Serving threads come first.  Linux takes a tid for a thread's nice.
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+    while (!serve_stop) {
+        int fd = accept(lfd, 0, 0);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        serve_client(fd);
+        close(fd);
+    }
+}
+
+extern "C" int dump_serve(const char* path) {
+    if (serve_thread) {
+        fprintf(stderr, "dump_serve is already serving %s\n",
+                serve_path.c_str());
+        return 1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "too long socket path: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Only a socket left by an earlier run is replaced.
+    struct stat sb;
+    if (!lstat(path, &sb) && S_ISSOCK(sb.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket(2) failed");
+        return 1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+        chmod(path, 0600) || listen(fd, 4))
+    {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+
+    serve_fd = fd;
+    serve_path = path;
+    serve_stop = false;
+    serve_thread = new thread(serve_main, fd);
+    return 0;
+}
+
+extern "C" void dump_serve_stop(void) {
+    if (!serve_thread) return;
+    serve_stop = true;
+    // Wakes up accept(2).
+    shutdown(serve_fd, SHUT_RDWR);
+    serve_thread->join();
+    delete serve_thread;
+    serve_thread = 0;
+    close(serve_fd);
+    serve_fd = -1;
+    unlink(serve_path.c_str());
+}
+
+// Snapshot mode: a forked child dumps its copy-on-write image of memory,
+// so the roots are consistent and the caller only waits for fork(2).  The
+// child must not take locks which other threads of the parent may have
+// held at the fork, so it writes with write(2) rather than stdio.
+
+extern "C" int dump_snapshot(const dump_root_t* roots, int n, int fd,
+                             dump_snapshot_t* snap) {
+    int status[2];
+    if (pipe(status)) {
+        perror("pipe(2) failed");
+        return 1;
+    }
+    // Constructing this in the child would lock stats_mu.
+    tstats();
+    // Held across fork(2), so the child gets a registry nobody was
+    // changing.  The child inherits registry_depth and never locks.
+    RegistryLock reg;
+
+    double start = now_sec();
+    pid_t pid = fork();
+    double forked = now_sec();
+    if (pid < 0) {
+        perror("fork(2) failed");
+        close(status[0]);
+        close(status[1]);
+        return 1;
+    }
+
+    if (pid == 0) {
+        close(status[0]);
+        signal(SIGPIPE, SIG_IGN);
+        string out;
+        EmitStream st = { fd, 0, (size_t)-1, HUGE_VAL, 0 };
+        emit_buf = &out;
+        emit_stream = &st;
+        int ret = 0;
+        try {
+            for (int i = 0; i < n; i++) {
+                const char* label = roots[i].label;
+                dump_unit(roots[i].p, dump_type_handle(roots[i].type),
+                          label ? label : roots[i].type);
+            }
+            emit("/* snapshot: fork %.3f ms, dump %.3f ms */\n",
+                 (forked - start) * 1e3, (now_sec() - forked) * 1e3);
+            flush_stream();
+        }
+        catch (const EmitLimit&) {
+            ret = 1;
+        }
+        double dump_sec = now_sec() - forked;
+        if (write(status[1], &dump_sec, sizeof(dump_sec)) < 0) ret = 1;
+        // No atexit handlers or stdio buffers of the parent.
+        _exit(ret);
+    }
+
+    close(status[1]);
+    snap->pid = pid;
+    snap->fork_sec = forked - start;
+    snap->dump_sec = 0;
+    snap->status_fd = status[0];
+    return 0;
+}
+
+extern "C" int dump_snapshot_wait(dump_snapshot_t* snap) {
+    double sec;
+    ssize_t r;
+    while ((r = read(snap->status_fd, &sec, sizeof(sec))) < 0 &&
+           errno == EINTR) {}
+    if (r == sizeof(sec)) snap->dump_sec = sec;
+    close(snap->status_fd);
+    snap->status_fd = -1;
+
+    int status;
+    while (waitpid(snap->pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Watch mode: watched objects live on read-only pages.  A write faults,
+// the SIGSEGV handler unprotects the page and sets the trap flag so the
+// writing instruction runs once, and the SIGTRAP handler compares the
+// objects on the faulting page with their snapshots, records changed
+// members and protects the page again.  The handlers only touch the
+// preallocated tables below.
+
+#if defined(__linux__) && defined(__x86_64__)
+
+static const int WATCH_MAX = 16;
+static const int WATCH_VALUE_MAX = 32;
+static const int WATCH_EVENTS = 1024;
+// Widest single store, an AVX-512 one.  String instructions trap after
+// each element when single-stepped.
+static const int WATCH_STORE_MAX = 64;
+static const long long EFLAGS_TF = 0x100;
+
+struct WatchMember {
+    int loc;
+    int size;
+    // Index into st->members().
+    int index;
+    // Largest loc+size of this and preceding members.
+    int end_max;
+};
+
+struct Watch {
+    char* addr;
+    int size;
+    DumpStruct* st;
+    char* snap;
+    // Sorted by loc.
+    WatchMember* members;
+    int num_members;
+};
+
+struct WatchEvent {
+    // Watched types are pinned, so this outlives dump_unwatch.
+    DumpStruct* st;
+    int member;
+    int offset;
+    int len;
+    void* pc;
+    unsigned char old_val[WATCH_VALUE_MAX];
+    unsigned char new_val[WATCH_VALUE_MAX];
+};
+
+// An unaligned write can fault on two pages.
+struct WatchPending {
+    int num;
+    char* addr[2];
+    void* pc;
+};
+
+static Watch watches[WATCH_MAX];
+static WatchEvent watch_events[WATCH_EVENTS];
+static atomic<unsigned int> watch_event_num;
+static __thread WatchPending watch_pending;
+static struct sigaction watch_old_segv, watch_old_trap;
+static bool watch_installed;
+static long page_size;
+
+static char* page_of(const void* p) {
+    return (char*)((unsigned long)p & ~(page_size - 1));
+}
+
+static bool watched_page(const char* page) {
+    for (int i = 0; i < WATCH_MAX; i++) {
+        const Watch& w = watches[i];
+        if (w.addr && page_of(w.addr) <= page &&
+            page <= page_of(w.addr + w.size - 1))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void watch_chain(struct sigaction* old, int sig, siginfo_t* si,
+                        void* ctx)
+{
+    if (old->sa_flags & SA_SIGINFO) {
+        if (old->sa_sigaction) {
+            old->sa_sigaction(sig, si, ctx);
+            return;
+        }
+    }
+    else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+        old->sa_handler(sig);
+        return;
+    }
+    // Let the signal be delivered again with the default action.
+    signal(sig, SIG_DFL);
+}
+
+static void watch_record(int wi, int member, int offset, int len, void* pc) {
+    Watch& w = watches[wi];
+    unsigned int n = watch_event_num.fetch_add(1);
+    WatchEvent& ev = watch_events[n % WATCH_EVENTS];
+    if (len > WATCH_VALUE_MAX) len = WATCH_VALUE_MAX;
+    ev.st = w.st;
+    ev.member = member;
+    ev.offset = offset;
+    ev.len = len;
+    ev.pc = pc;
+    memcpy(ev.old_val, w.snap + offset, len);
+    memcpy(ev.new_val, w.addr + offset, len);
+}
+
+// Records changes in [from, to) of a watched object and refreshes the
+// snapshot of that range.
+static void watch_diff(int wi, int from, int to, void* pc) {
+    Watch& w = watches[wi];
+    int lo = 0, hi = w.num_members;
+    // First member which may overlap `from'.
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (w.members[mid].end_max <= from) lo = mid + 1;
+        else hi = mid;
+    }
+    for (int i = lo; i < w.num_members && w.members[i].loc < to; i++) {
+        const WatchMember& m = w.members[i];
+        int b = max(m.loc, from);
+        int e = min(m.loc + m.size, to);
+        if (b >= e || !memcmp(w.snap + b, w.addr + b, e - b)) continue;
+        // Other bitfields of the unit may be what changed.
+        const DumpStruct::Member& mem = w.st->members()[m.index];
+        if (mem.bits && DumpStruct::loadBits(mem, w.snap + m.loc, false) ==
+            DumpStruct::loadBits(mem, w.addr + m.loc, false)) {
+            continue;
+        }
+        if (m.size <= WATCH_VALUE_MAX) {
+            watch_record(wi, m.index, m.loc, m.size, pc);
+        }
+        else {
+            while (b < e && w.snap[b] == w.addr[b]) b++;
+            watch_record(wi, m.index, b, e - b, pc);
+        }
+    }
+    memcpy(w.snap + from, w.addr + from, to - from);
+}
+
+static void watch_segv(int sig, siginfo_t* si, void* ctx) {
+    char* addr = (char*)si->si_addr;
+    if (watch_pending.num == 2 || !watched_page(page_of(addr))) {
+        watch_chain(&watch_old_segv, sig, si, ctx);
+        return;
+    }
+    ucontext_t* uc = (ucontext_t*)ctx;
+    watch_pending.addr[watch_pending.num++] = addr;
+    watch_pending.pc = (void*)uc->uc_mcontext.gregs[REG_RIP];
+    mprotect(page_of(addr), page_size, PROT_READ | PROT_WRITE);
+    uc->uc_mcontext.gregs[REG_EFL] |= EFLAGS_TF;
+}
+
+static void watch_trap(int sig, siginfo_t* si, void* ctx) {
+    if (!watch_pending.num) {
+        watch_chain(&watch_old_trap, sig, si, ctx);
+        return;
+    }
+    ucontext_t* uc = (ucontext_t*)ctx;
+    uc->uc_mcontext.gregs[REG_EFL] &= ~EFLAGS_TF;
+
+    // A store which crosses into the page faults at the page start, so
+    // bytes up to a store width before the address may have changed too.
+    for (int i = 0; i < WATCH_MAX; i++) {
+        const Watch& w = watches[i];
+        if (!w.addr) continue;
+        for (int n = 0; n < watch_pending.num; n++) {
+            long off = watch_pending.addr[n] - w.addr;
+            long from = max(off - (WATCH_STORE_MAX - 1), 0L);
+            long to = min(off + WATCH_STORE_MAX, (long)w.size);
+            if (from < to) watch_diff(i, from, to, watch_pending.pc);
+        }
+    }
+    for (int n = 0; n < watch_pending.num; n++) {
+        mprotect(page_of(watch_pending.addr[n]), page_size, PROT_READ);
+    }
+    watch_pending.num = 0;
+}
+
+static int install_watch_handlers() {
+    if (watch_installed) return 0;
+    page_size = sysconf(_SC_PAGESIZE);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = watch_segv;
+    if (sigaction(SIGSEGV, &sa, &watch_old_segv)) {
+        perror("sigaction(2) failed");
+        return 1;
+    }
+    sa.sa_sigaction = watch_trap;
+    if (sigaction(SIGTRAP, &sa, &watch_old_trap)) {
+        perror("sigaction(2) failed");
+        return 1;
+    }
+    watch_installed = true;
+    return 0;
+}
+
+static bool member_less(const WatchMember& a, const WatchMember& b) {
+    return a.loc < b.loc;
+}
+
+extern "C" int dump_watch(void* p, const char* type) {
+    RegistryLock reg;
+    DumpStruct* st = dynamic_cast<DumpStruct*>(strip_unit(find_type(type)));
+    if (!st || st->size() <= 0) {
+        tstats().lookup_misses.add(1);
+        fprintf(stderr, "cannot find struct %s\n", type);
+        return 1;
+    }
+    if (install_watch_handlers()) return 1;
+    pin_unit(st);
+
+    int wi;
+    for (wi = 0; wi < WATCH_MAX; wi++) {
+        if (!watches[wi].addr) break;
+    }
+    if (wi == WATCH_MAX) {
+        fprintf(stderr, "too many watches\n");
+        return 1;
+    }
+
+    const vector<DumpStruct::Member>& mems = st->members();
+    Watch w;
+    w.addr = (char*)p;
+    w.size = st->size();
+    w.st = st;
+    w.snap = new char[w.size];
+    memcpy(w.snap, p, w.size);
+    w.num_members = 0;
+    w.members = new WatchMember[mems.size()];
+    for (size_t i = 0; i < mems.size(); i++) {
+        DumpUnit* u = find_unit(mems[i].type);
+        // Static members have no location.
+        if (mems[i].loc < 0 || !u || u->size() <= 0) continue;
+        WatchMember& m = w.members[w.num_members++];
+        m.loc = mems[i].loc;
+        m.size = mems[i].bits ? mems[i].unit : u->size();
+        m.index = i;
+    }
+    stable_sort(w.members, w.members + w.num_members, member_less);
+    int end_max = 0;
+    for (int i = 0; i < w.num_members; i++) {
+        end_max = max(end_max, w.members[i].loc + w.members[i].size);
+        w.members[i].end_max = end_max;
+    }
+    watches[wi] = w;
+
+    char* begin = page_of(w.addr);
+    char* end = page_of(w.addr + w.size - 1) + page_size;
+    if (mprotect(begin, end - begin, PROT_READ)) {
+        perror("mprotect(2) failed");
+        delete[] w.snap;
+        delete[] w.members;
+        watches[wi].addr = 0;
+        return 1;
+    }
+    return 0;
+}
+
+extern "C" void dump_unwatch(void* p) {
+    for (int i = 0; i < WATCH_MAX; i++) {
+        Watch& w = watches[i];
+        if (w.addr != p) continue;
+        char* begin = page_of(w.addr);
+        char* end = page_of(w.addr + w.size - 1) + page_size;
+        w.addr = 0;
+        for (char* page = begin; page < end; page += page_size) {
+            if (!watched_page(page)) {
+                mprotect(page, page_size, PROT_READ | PROT_WRITE);
+            }
+        }
+        delete[] w.snap;
+        delete[] w.members;
+        return;
+    }
+}
+
+// Snapshots are copies of watched objects, vptrs included.
+static bool in_watch_snapshot(const char* p) {
+    for (int i = 0; i < WATCH_MAX; i++) {
+        const Watch& w = watches[i];
+        if (w.addr && w.snap <= p && p < w.snap + w.size) return true;
+    }
+    return false;
+}
+
+extern "C" void dump_watch_report() {
+    RegistryLock reg;
+    unsigned int num = watch_event_num.load();
+    unsigned int start =
+        num > (unsigned int)WATCH_EVENTS ? num - WATCH_EVENTS : 0;
+    for (unsigned int n = start; n < num; n++) {
+        const WatchEvent& ev = watch_events[n % WATCH_EVENTS];
+        DumpStruct* st = ev.st;
+        const DumpStruct::Member* mem = 0;
+        if (st && ev.member >= 0 && ev.member < (int)st->members().size()) {
+            mem = &st->members()[ev.member];
+        }
+
+        const func* f = find_func(ev.pc);
+        emit("%s.%s written by ", st ? st->name().c_str() : "???",
+             mem ? mem->name.c_str() : "???");
+        if (f) emit("%s+0x%lx", f->name.c_str(),
+                    (char*)ev.pc - (char*)f->low);
+        else emit("???");
+        emit(" [%p]\n", ev.pc);
+
+        DumpUnit* u = mem ? find_unit(mem->type) : 0;
+        bool whole = mem && u && ev.offset == mem->loc &&
+            ev.len == (mem->bits ? mem->unit : u->size());
+        for (int i = 0; i < 2; i++) {
+            const unsigned char* val = i == 0 ? ev.old_val : ev.new_val;
+            emit("  %s = ", i == 0 ? "old" : "new");
+            if (whole) {
+                unsigned char buf[WATCH_VALUE_MAX];
+                memcpy(buf, val, ev.len);
+                disp_ptrs.clear();
+                if (mem->bits) DumpStruct::dumpBits(*mem, (char*)buf, u);
+                else u->dump(buf);
+            }
+            else {
+                emit("+%d:", ev.offset - (mem ? mem->loc : 0));
+                for (int j = 0; j < ev.len; j++) emit(" %02x", val[j]);
+            }
+            emit("\n");
+        }
+    }
+}
+
+#else
+
+extern "C" int dump_watch(void*, const char*) {
+    fprintf(stderr, "dump_watch is not supported on this platform\n");
+    return 1;
+}
+
+extern "C" void dump_unwatch(void*) {
+}
+
+extern "C" void dump_watch_report() {
+}
+
+static bool in_watch_snapshot(const char*) {
+    return false;
+}
+
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Registers of a frame which are known by following frame pointers.
+struct FrameRegs {
+    char* pc;
+    char* fp;
+    char* sp;
+    char* cfa;
+};
+
+#if defined(__x86_64__)
+static const int DWARF_REG_FP = 6;
+static const int DWARF_REG_SP = 7;
+#else
+static const int DWARF_REG_FP = 5;
+static const int DWARF_REG_SP = 4;
+#endif
+
+static const int DUMP_LOCALS_MAX_FRAMES = 64;
+
+enum { LOC_NONE, LOC_ADDR, LOC_VALUE };
+
+static char* frame_reg(const FrameRegs& r, int reg) {
+    if (reg == DWARF_REG_FP) return r.fp;
+    if (reg == DWARF_REG_SP) return r.sp;
+    return 0;
+}
+
+// Evaluates the location valid at r.pc.  Returns LOC_ADDR with the
+// address of the object, LOC_VALUE with the value itself, or LOC_NONE if
+// it lives in a register we do not know or was optimized out.
+static int eval_location(const vector<location>& locs, const FrameRegs& r,
+                         char* fb, uintptr_t* out)
+{
+    static const int STACK_SIZE = 16;
+    const location* l = 0;
+    for (size_t i = 0; i < locs.size(); i++) {
+        if (locs[i].low <= (Dwarf_Addr)r.pc &&
+            (Dwarf_Addr)r.pc < locs[i].high)
+        {
+            l = &locs[i];
+            break;
+        }
+    }
+    if (!l) return LOC_NONE;
+
+    uintptr_t stack[STACK_SIZE];
+    int sp = 0;
+    for (size_t i = 0; i < l->ops.size(); i++) {
+        int a = l->ops[i].lr_atom;
+        Dwarf_Unsigned n = l->ops[i].lr_number;
+        if (sp == STACK_SIZE) return LOC_NONE;
+
+        if (a == DW_OP_addr) {
+            stack[sp++] = n + base_addr;
+        }
+        else if (a == DW_OP_fbreg) {
+            if (!fb) return LOC_NONE;
+            stack[sp++] = (uintptr_t)fb + (Dwarf_Signed)n;
+        }
+        else if (a == DW_OP_call_frame_cfa) {
+            stack[sp++] = (uintptr_t)r.cfa;
+        }
+        else if (a >= DW_OP_breg0 && a <= DW_OP_breg31) {
+            char* reg = frame_reg(r, a - DW_OP_breg0);
+            if (!reg) return LOC_NONE;
+            stack[sp++] = (uintptr_t)reg + (Dwarf_Signed)n;
+        }
+        else if (a >= DW_OP_reg0 && a <= DW_OP_reg31) {
+            char* reg = frame_reg(r, a - DW_OP_reg0);
+            if (!reg) return LOC_NONE;
+            *out = (uintptr_t)reg;
+            return LOC_VALUE;
+        }
+        else if (a == DW_OP_stack_value && sp) {
+            *out = stack[sp-1];
+            return LOC_VALUE;
+        }
+        else if (!eval_stack_op(a, n, stack, &sp)) {
+            // Pieces, entry values, bad derefs and so on.
+            return LOC_NONE;
+        }
+    }
+    if (!sp) return LOC_NONE;
+    *out = stack[sp-1];
+    return LOC_ADDR;
+}
+
+static void dump_frame_locals(const func* f, const FrameRegs& r) {
+    uintptr_t fb = 0;
+    if (eval_location(f->frame_base, r, 0, &fb) == LOC_NONE) fb = 0;
+
+    for (size_t i = 0; i < f->locals.size(); i++) {
+        const local& l = f->locals[i];
+        if (l.low && (r.pc < l.low || l.high <= r.pc)) continue;
+
+        DumpUnit* u = find_unit(l.type);
+        emit("    %s = ", l.name.c_str());
+        uintptr_t v;
+        int kind = eval_location(l.loc, r, (char*)fb, &v);
+        if (!u) {
+            emit("???");
+        }
+        else if (kind == LOC_NONE ||
+                 (kind == LOC_VALUE && (u->size() < 0 ||
+                                        u->size() > (int)sizeof(v))))
+        {
+            emit("<optimized out>");
+        }
+        else if (kind == LOC_VALUE) {
+            u->dump(&v);
+        }
+        else if (!is_readable((void*)v)) {
+            emit("[%p] <invalid ptr>", (void*)v);
+        }
+        else {
+            u->dump((void*)v);
+        }
+        emit(" : %s\n", u ? u->name().c_str() : "???");
+    }
+}
+
+// Walks frame pointers, so callers need -fno-omit-frame-pointer (or -O0).
+extern "C" void dump_locals(int max_frames) {
+    RegistryLock reg;
+    disp_ptrs.clear();
+    tstats().dump_calls.add(1);
+    if (max_frames <= 0) max_frames = DUMP_LOCALS_MAX_FRAMES;
+
+    // Skip the frame of dump_locals itself.
+    char** fp = (char**)__builtin_frame_address(0);
+    for (int n = 0; n < max_frames; n++) {
+        if (!is_readable(fp) || !is_readable(fp + 1)) break;
+        char** caller_fp = (char**)fp[0];
+        char* ret = fp[1];
+        if (!ret) break;
+
+        FrameRegs r;
+        // Look up the call instruction, not the one after it.
+        r.pc = ret - 1;
+        r.fp = (char*)caller_fp;
+        r.sp = (char*)(fp + 2);
+        r.cfa = (char*)(caller_fp + 2);
+
+        const func* f = find_func(r.pc);
+        emit("#%d %p in %s\n", n, ret, f ? f->name.c_str() : "??");
+        if (f) dump_frame_locals(f, r);
+
+        // Frames above main are not ours, and the stack grows down.
+        if (f && f->name == "main") break;
+        if (caller_fp <= fp) break;
+        fp = caller_fp;
+    }
+    enforce_budget();
+}
+
+#else
+
+extern "C" void dump_locals(int) {
+    fprintf(stderr, "dump_locals is not supported on this platform\n");
+}
+
+#endif
+
+extern "C" int dump_set_memory_budget(unsigned long long bytes) {
+    // Groups are only recorded while loading.
+    if (opened && !memory_budget) {
+        fprintf(stderr, "dump_set_memory_budget must precede dump_open\n");
+        return 1;
+    }
+    if (!bytes && memory_budget) {
+        fprintf(stderr, "memory budget can't be removed after dump_open\n");
+        return 1;
+    }
+    memory_budget = bytes;
+    enforce_budget();
+    return 0;
+}
+
+// Appends the indexes of words equal to `target'.  Most words don't
+// match, so blocks are rejected with SIMD compares and only candidate
+// blocks are checked word by word.
+static void scan_words(const uint64_t* words, size_t n, uint64_t target,
+                       vector<size_t>* hits)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i t = _mm256_set1_epi64x(target);
+    for (; i + 8 <= n; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(words + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(words + i + 4));
+        __m256i c = _mm256_or_si256(_mm256_cmpeq_epi64(a, t),
+                                    _mm256_cmpeq_epi64(b, t));
+        if (!_mm256_movemask_epi8(c)) continue;
+        for (size_t j = i; j < i + 8; j++) {
+            if (words[j] == target) hits->push_back(j);
+        }
+    }
+#elif defined(__SSE2__)
+    // No 64-bit compare in SSE2; a 32-bit match only marks a candidate.
+    __m128i t = _mm_set1_epi64x(target);
+    for (; i + 8 <= n; i += 8) {
+        const __m128i* v = (const __m128i*)(words + i);
+        __m128i c = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(_mm_loadu_si128(v), t),
+                         _mm_cmpeq_epi32(_mm_loadu_si128(v + 1), t)),
+            _mm_or_si128(_mm_cmpeq_epi32(_mm_loadu_si128(v + 2), t),
+                         _mm_cmpeq_epi32(_mm_loadu_si128(v + 3), t)));
+        if (!_mm_movemask_epi8(c)) continue;
+        for (size_t j = i; j < i + 8; j++) {
+            if (words[j] == target) hits->push_back(j);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (words[i] == target) hits->push_back(i);
+    }
+}
+
+struct Mapping {
+    char* begin;
+    char* end;
+};
+
+// Writable anonymous mappings: the heap, stacks and mmap'ed arenas.
+// Globals in file-backed .data are skipped; they can be dumped by name.
+static void anon_mappings(vector<Mapping>* maps) {
+    FILE* fp = fopen("/proc/self/maps", "r");
+    if (!fp) return;
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long b, e, inode;
+        char perms[5];
+        int n = 0;
+        if (sscanf(line, "%lx-%lx %4s %*s %*s %lu %n", &b, &e, perms, &inode,
+                   &n) != 4) {
+            continue;
+        }
+        if (perms[0] != 'r' || perms[1] != 'w' || inode) continue;
+        const char* path = line + n;
+        if (*path && *path != '[') continue;
+        if (!strncmp(path, "[vvar]", 6) || !strncmp(path, "[vsyscall]", 10)) {
+            continue;
+        }
+        Mapping m;
+        m.begin = (char*)b;
+        m.end = (char*)e;
+        maps->push_back(m);
+    }
+    fclose(fp);
+}
+
+extern "C" long dump_instances(const char* type, int max_dump) {
+    RegistryLock reg;
+    DumpStruct* st = dynamic_cast<DumpStruct*>(strip_unit(find_type(type)));
+    if (!st || st->size() <= 0) {
+        tstats().lookup_misses.add(1);
+        emit("cannot find struct %s\n", type);
+        return -1;
+    }
+    uint64_t target = 0;
+    for (size_t i = 0; i < vtables.size(); i++) {
+        if (vtables[i].name == st->name()) target = (uint64_t)vtables[i].addr;
+    }
+    if (!target) {
+        emit("cannot find vtable of %s\n", type);
+        return -1;
+    }
+
+    vector<Mapping> maps;
+    anon_mappings(&maps);
+
+    // Words of our own which hold vptrs: the vtable table and its index.
+    // `target' and the SIMD scan may spill to this thread's stack, which
+    // is skipped as a whole.
+    set<char*> own;
+    for (size_t i = 0; i < vtables.size(); i++) {
+        own.insert((char*)&vtables[i].addr);
+    }
+    for (unordered_map<void*, int>::const_iterator ite = vtable_index.begin();
+         ite != vtable_index.end(); ++ite)
+    {
+        own.insert((char*)&ite->first);
+    }
+    char here;
+
+    // Memory is copied with process_vm_readv so that a mapping which goes
+    // away while scanning can't crash us.
+    static const size_t CHUNK = 1 << 20;
+    vector<uint64_t> buf(CHUNK / sizeof(uint64_t));
+    char* buf_begin = (char*)&buf[0];
+    char* buf_end = buf_begin + CHUNK;
+    vector<size_t> hits;
+    vector<char*> found;
+    unsigned long long scanned = 0;
+    double start = now_sec();
+    for (size_t m = 0; m < maps.size(); m++) {
+        if (maps[m].begin <= &here && &here < maps[m].end) continue;
+        for (char* p = maps[m].begin; p < maps[m].end; p += CHUNK) {
+            size_t len = min((size_t)(maps[m].end - p), CHUNK);
+            struct iovec local = { buf_begin, len };
+            struct iovec remote = { p, len };
+            ssize_t r = process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+            if (r <= 0) continue;
+            scanned += r;
+            hits.clear();
+            scan_words(&buf[0], r / sizeof(uint64_t), target, &hits);
+            for (size_t h = 0; h < hits.size(); h++) {
+                char* obj = p + hits[h] * sizeof(uint64_t);
+                // Our own copy of the memory.
+                if (obj >= buf_begin && obj < buf_end) continue;
+                // A whole object fits in the mapping.
+                if (obj + st->size() > maps[m].end) continue;
+                if (own.count(obj) || in_watch_snapshot(obj)) continue;
+                found.push_back(obj);
+            }
+        }
+    }
+    double sec = now_sec() - start;
+
+    // Other threads may free what was found, so it is dumped from copies.
+    long num = found.size();
+    MemImage image;
+    image.live = true;
+    ImageScope scope(&image);
+    for (long i = 0; i < num && i < max_dump; i++) {
+        disp_ptrs.clear();
+        emit("%s [%p] = ", st->name().c_str(), found[i]);
+        if (void* copy = image.find(found[i], st->size())) st->dump(copy);
+        else emit("<invalid ptr>");
+        emit("\n");
+    }
+    emit("found %ld %s in %llu bytes (%.2f GB/s)\n", num, st->name().c_str(),
+         scanned, sec > 0 ? scanned / sec / 1e9 : 0.0);
+    enforce_budget();
+    return num;
+}
+
+// Crash mode: each registered root is compiled into a flat plan of ops
+// while it is still safe to allocate.  The fatal signal handler then only
+// runs the plans, reads memory with process_vm_readv so that a bad
+// pointer fails with EFAULT instead of faulting again, and formats into a
+// fixed buffer written to the fd.  Nothing there mallocs or uses stdio.
+
+enum CrashOpKind {
+    CRASH_TEXT,
+    CRASH_INT,
+    CRASH_UINT,
+    CRASH_CHAR,
+    CRASH_BOOL,
+    CRASH_HEX,
+    CRASH_ENUM,
+    CRASH_PTR,
+    CRASH_STR,
+    CRASH_CHARS,
+    CRASH_DEREF,
+    CRASH_POP,
+};
+
+struct CrashOp {
+    CrashOpKind kind;
+    // From the current base address.
+    int offset;
+    int size;
+    // Index of the text or enum table, or of the matching CRASH_POP.
+    int arg;
+    // Of a bitfield, which is in the `size' bytes at `offset'.
+    unsigned char bits;
+    unsigned char shift;
+};
+
+struct CrashPlan {
+    void* root;
+    vector<CrashOp> ops;
+    vector<string> texts;
+    vector<vector<pair<int, string> > > enums;
+};
+
+static const int CRASH_MAX_DEPTH = 16;
+static const int CRASH_STR_MAX = 64;
+
+static vector<CrashPlan> crash_plans;
+static int crash_fd = -1;
+static atomic<int> crash_running;
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static const int CRASH_SIGNUM =
+    sizeof(crash_signals) / sizeof(crash_signals[0]);
+static struct sigaction crash_old[CRASH_SIGNUM];
+
+static void crash_op(CrashPlan* plan, CrashOpKind kind, int offset, int size,
+                     int arg = 0)
+{
+    CrashOp op;
+    op.kind = kind;
+    op.offset = offset;
+    op.size = size;
+    op.arg = arg;
+    op.bits = op.shift = 0;
+    plan->ops.push_back(op);
+}
+
+static void crash_text(CrashPlan* plan, const string& text) {
+    // Merge with the previous text to keep plans short.
+    if (!plan->ops.empty() && plan->ops.back().kind == CRASH_TEXT) {
+        plan->texts[plan->ops.back().arg] += text;
+        return;
+    }
+    crash_op(plan, CRASH_TEXT, 0, 0, plan->texts.size());
+    plan->texts.push_back(text);
+}
+
+// Mirrors DumpUnit::dump, with the same nesting limit.
+static void compile_crash(DumpUnit* unit, int offset, int nest,
+                          CrashPlan* plan)
+{
+    DumpUnit* u = strip_unit(unit);
+    if (!u) {
+        crash_text(plan, "<void>");
+    }
+    else if (DumpPrim* prim = dynamic_cast<DumpPrim*>(u)) {
+        PrimClass k = prim->klass();
+        int size = prim->size();
+        if (k == PRIM_BOOL) {
+            crash_op(plan, CRASH_BOOL, offset, size);
+        }
+        else if (k == PRIM_CHAR) {
+            crash_op(plan, CRASH_CHAR, offset, size);
+        }
+        else if (k == PRIM_FLOAT || size > 8) {
+            crash_op(plan, CRASH_HEX, offset, min(size, 8));
+        }
+        else if (k == PRIM_UNSIGNED) {
+            crash_op(plan, CRASH_UINT, offset, size);
+        }
+        else {
+            crash_op(plan, CRASH_INT, offset, size);
+        }
+    }
+    else if (DumpEnum* en = dynamic_cast<DumpEnum*>(u)) {
+        const map<int, string>& enums = en->enums();
+        int size = en->size() > 0 ? min(en->size(), 8) : 4;
+        crash_op(plan, CRASH_ENUM, offset, size, plan->enums.size());
+        plan->enums.push_back(
+            vector<pair<int, string> >(enums.begin(), enums.end()));
+    }
+    else if (DumpStruct* st = dynamic_cast<DumpStruct*>(u)) {
+        if (nest > DUMP_RECURSIVE_LEVEL*2) {
+            crash_text(plan, "{ ... }");
+            return;
+        }
+        crash_text(plan, "{\n");
+        const vector<DumpStruct::Member>& mems = st->members();
+        for (size_t i = 0; i < mems.size(); i++) {
+            if (mems[i].loc < 0) continue;
+            DumpUnit* mu = find_unit(mems[i].type);
+            crash_text(plan, string(nest + 2, ' ') + mems[i].name + " = ");
+            size_t first = plan->ops.size();
+            compile_crash(mu, offset + mems[i].loc, nest + 2, plan);
+            string type = mu ? mu->name() : string("???");
+            // The type of a bitfield compiles to one op, which extracts it.
+            if (mems[i].bits && plan->ops.size() == first + 1 &&
+                plan->ops.back().kind != CRASH_TEXT) {
+                CrashOp& op = plan->ops.back();
+                op.size = mems[i].unit;
+                op.bits = mems[i].bits;
+                op.shift = mems[i].shift;
+                char bits[16];
+                sprintf(bits, ":%d", mems[i].bits);
+                type += bits;
+            }
+            crash_text(plan, " : " + type + "\n");
+        }
+        crash_text(plan, string(nest, ' ') + "}");
+    }
+    else if (DumpArray* a = dynamic_cast<DumpArray*>(u)) {
+        DumpUnit* e = find_unit(a->type());
+        if (a->count() < 1 || !e) {
+            crash_text(plan, "{}");
+        }
+        else if (e->name() == "char") {
+            crash_op(plan, CRASH_CHARS, offset, a->count());
+        }
+        else {
+            crash_text(plan, "{ ");
+            compile_crash(e, offset, nest, plan);
+            crash_text(plan, a->count() > 1 ? ", ... }" : " }");
+        }
+    }
+    else if (DumpPtr* ptr = dynamic_cast<DumpPtr*>(u)) {
+        DumpUnit* t = find_unit(ptr->type());
+        if (t && t->name() == "char") {
+            crash_op(plan, CRASH_STR, offset, sizeof(void*));
+        }
+        else if (t && dynamic_cast<DumpStruct*>(strip_unit(t)) &&
+                 nest <= DUMP_RECURSIVE_LEVEL*2 &&
+                 nest / 2 < CRASH_MAX_DEPTH - 1)
+        {
+            size_t deref = plan->ops.size();
+            crash_op(plan, CRASH_DEREF, offset, sizeof(void*));
+            compile_crash(t, 0, nest, plan);
+            plan->ops[deref].arg = plan->ops.size();
+            crash_op(plan, CRASH_POP, 0, 0);
+        }
+        else {
+            crash_op(plan, CRASH_PTR, offset, sizeof(void*));
+        }
+    }
+    else {
+        // Functions are shown by address only.
+        crash_op(plan, CRASH_PTR, offset, sizeof(void*));
+    }
+}
+
+namespace {
+    // Fixed buffer writer usable in a signal handler.
+    class CrashOut {
+    public:
+        explicit CrashOut(int fd) : fd_(fd), len_(0) {}
+        ~CrashOut() { flush(); }
+
+        void put(const char* s, size_t n) {
+            while (n) {
+                if (len_ == sizeof(buf_)) flush();
+                size_t c = min(n, sizeof(buf_) - len_);
+                memcpy(buf_ + len_, s, c);
+                len_ += c;
+                s += c;
+                n -= c;
+            }
+        }
+        void put(const char* s) { put(s, strlen(s)); }
+        void put(char c) { put(&c, 1); }
+
+        void putDec(unsigned long long v, bool neg) {
+            char tmp[24];
+            int i = sizeof(tmp);
+            do {
+                tmp[--i] = '0' + v % 10;
+                v /= 10;
+            } while (v);
+            if (neg) tmp[--i] = '-';
+            put(tmp + i, sizeof(tmp) - i);
+        }
+
+        void putHex(unsigned long long v, int digits) {
+            static const char hex[] = "0123456789abcdef";
+            char tmp[18];
+            tmp[0] = '0';
+            tmp[1] = 'x';
+            for (int i = 0; i < digits; i++) {
+                tmp[1 + digits - i] = hex[(v >> (i * 4)) & 15];
+            }
+            put(tmp, digits + 2);
+        }
+
+        void putEscaped(const char* s, int n) {
+            for (int i = 0; i < n; i++) {
+                unsigned char c = s[i];
+                if (c >= 0x20 && c < 0x7f) {
+                    put((char)c);
+                }
+                else {
+                    char esc[4] = { '\\', 'x', HEX_DIGITS[c >> 4],
+                                    HEX_DIGITS[c & 15] };
+                    put(esc, 4);
+                }
+            }
+        }
+
+        void flush() {
+            size_t off = 0;
+            while (off < len_) {
+                ssize_t r = write(fd_, buf_ + off, len_ - off);
+                if (r <= 0) break;
+                off += r;
+            }
+            len_ = 0;
+        }
+
+    private:
+        int fd_;
+        size_t len_;
+        char buf_[4096];
+    };
+}
+
+// Returns the number of bytes copied; a bad address gives less.
+static ssize_t safe_read(void* dst, const void* src, size_t len) {
+    return read_bounded(dst, src, len);
+}
+
+static void run_crash_plan(const CrashPlan& plan, CrashOut* out) {
+    char* stack[CRASH_MAX_DEPTH];
+    int sp = 0;
+    char* base = (char*)plan.root;
+    for (size_t i = 0; i < plan.ops.size(); i++) {
+        const CrashOp& op = plan.ops[i];
+        char* addr = base + op.offset;
+        if (op.kind == CRASH_TEXT) {
+            out->put(plan.texts[op.arg].c_str());
+            continue;
+        }
+        if (op.kind == CRASH_POP) {
+            out->put(" [");
+            out->putHex((unsigned long)base, 16);
+            out->put("]");
+            base = stack[--sp];
+            continue;
+        }
+        if (op.kind == CRASH_CHARS) {
+            char buf[CRASH_STR_MAX];
+            int n = safe_read(buf, addr, min(op.size, CRASH_STR_MAX));
+            int len = 0;
+            while (len < n && buf[len]) len++;
+            out->put("\"");
+            out->putEscaped(buf, len);
+            out->put(len == op.size || len < n ? "\"" : "...\"");
+            continue;
+        }
+
+        unsigned long long v = 0;
+        if (safe_read(&v, addr, op.size) != op.size) {
+            out->put("<unreadable>");
+            if (op.kind == CRASH_DEREF) i = op.arg;
+            continue;
+        }
+        // Little endian: sign extend from the top bit read.
+        int width = op.size * 8;
+        if (op.bits) {
+            v = v >> op.shift & (~0ULL >> (64 - op.bits));
+            width = op.bits;
+        }
+        long long sv = v;
+        if (width < 64 && (v >> (width - 1)) & 1) {
+            sv = (long long)(v | (~0ULL << width));
+        }
+
+        switch (op.kind) {
+        case CRASH_INT:
+            out->putDec(sv < 0 ? -(unsigned long long)sv : sv, sv < 0);
+            break;
+        case CRASH_UINT:
+            out->putDec(v, false);
+            break;
+        case CRASH_CHAR:
+            out->put("'");
+            out->putEscaped((const char*)&v, 1);
+            out->put("'");
+            break;
+        case CRASH_BOOL:
+            out->put(v ? "true" : "false");
+            break;
+        case CRASH_HEX:
+        case CRASH_PTR:
+            out->putHex(v, op.size * 2);
+            break;
+        case CRASH_ENUM: {
+            const vector<pair<int, string> >& en = plan.enums[op.arg];
+            // A small enum may have an unsigned underlying type.
+            size_t j;
+            for (j = 0; j < en.size(); j++) {
+                if (en[j].first == (int)sv) break;
+            }
+            if (j == en.size() && width < 32) {
+                for (j = 0; j < en.size(); j++) {
+                    if (en[j].first == (int)v) break;
+                }
+                if (j < en.size()) sv = v;
+            }
+            if (j < en.size()) out->put(en[j].second.c_str());
+            else out->putDec(sv < 0 ? -(unsigned long long)sv : sv, sv < 0);
+            break;
+        }
+        case CRASH_STR: {
+            char buf[CRASH_STR_MAX];
+            int n = v ? safe_read(buf, (void*)v, sizeof(buf)) : 0;
+            int len = 0;
+            while (len < n && buf[len]) len++;
+            if (!n) {
+                out->putHex(v, 16);
+                out->put(" <invalid ptr>");
+                break;
+            }
+            out->put("\"");
+            out->putEscaped(buf, len);
+            out->put(len < n ? "\" [" : "...\" [");
+            out->putHex(v, 16);
+            out->put("]");
+            break;
+        }
+        case CRASH_DEREF: {
+            char probe;
+            if (!v || !safe_read(&probe, (void*)v, 1)) {
+                out->putHex(v, 16);
+                out->put(" <invalid ptr>");
+                i = op.arg;
+                break;
+            }
+            stack[sp++] = base;
+            base = (char*)v;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+static void crash_handler(int sig, siginfo_t*, void*) {
+    // A fault while dumping must not start over.
+    if (crash_running.exchange(1) == 0 && crash_fd >= 0) {
+        CrashOut out(crash_fd);
+        out.put("*** dumper: caught signal ");
+        out.putDec(sig, false);
+        out.put("\n");
+        for (size_t i = 0; i < crash_plans.size(); i++) {
+            out.put(crash_plans[i].texts[0].c_str());
+            run_crash_plan(crash_plans[i], &out);
+            out.put("\n");
+        }
+    }
+    for (int i = 0; i < CRASH_SIGNUM; i++) {
+        if (crash_signals[i] == sig) sigaction(sig, &crash_old[i], 0);
+    }
+    raise(sig);
+}
+
+extern "C" int dump_crash_register(void* p, const char* type,
+                                   const char* label)
+{
+    RegistryLock reg;
+    DumpUnit* u = find_type(type);
+    if (!u) {
+        tstats().lookup_misses.add(1);
+        fprintf(stderr, "cannot find type info of %s\n", type);
+        return 1;
+    }
+    CrashPlan plan;
+    plan.root = p;
+    // texts[0] is the header printed before running the plan.
+    plan.texts.push_back(string(label ? label : type) + " = ");
+    compile_crash(u, 0, 0, &plan);
+    crash_text(&plan, " : " + u->name());
+    crash_plans.push_back(plan);
+    return 0;
+}
+
+extern "C" int dump_crash_install(int fd) {
+    static char* altstack;
+    crash_fd = fd;
+    if (!altstack) {
+        // Stack overflows are crashes too.
+        altstack = new char[SIGSTKSZ * 4];
+        stack_t ss;
+        ss.ss_sp = altstack;
+        ss.ss_size = SIGSTKSZ * 4;
+        ss.ss_flags = 0;
+        if (sigaltstack(&ss, 0)) {
+            perror("sigaltstack(2) failed");
+            return 1;
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = crash_handler;
+    for (int i = 0; i < CRASH_SIGNUM; i++) {
+        if (sigaction(crash_signals[i], &sa, &crash_old[i])) {
+            perror("sigaction(2) failed");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Aggregation mode: dump_s folds each primitive leaf of the value into
+// running statistics instead of printing it.  Every thread updates its
+// own AggThread with relaxed stores, so the hot path takes no lock once a
+// thread has seen a call site.  Reports read all threads' copies.
+
+enum AggKind {
+    AGG_SIGNED,
+    AGG_UNSIGNED,
+    AGG_FLOAT,
+    AGG_ENUM,
+};
+
+struct AggLeaf {
+    string path;
+    int offset;
+    int size;
+    AggKind kind;
+    // A bitfield in the `size' bytes at `offset'.
+    DumpStruct::Member bitfield;
+    // Sorted enumerators of AGG_ENUM leaves.
+    vector<pair<int, string> > enums;
+};
+
+// Buckets are [2^e, 2^(e+1)) for e in [0, 64) on both sides of (-1, 1).
+static const int AGG_BUCKETS = 129;
+static const int AGG_ZERO_BUCKET = 64;
+static const int AGG_MAX_LEAVES = 256;
+static const int AGG_MAX_ARRAY = 16;
+
+struct AggField {
+    AggField() : freq(0) {}
+    ~AggField() { delete[] freq; }
+
+    Counter count;
+    atomic<double> min;
+    atomic<double> max;
+    atomic<double> sum;
+    Counter buckets[AGG_BUCKETS];
+    // Per enumerator, and one more for unknown values.
+    Counter* freq;
+};
+
+struct AggThread {
+    explicit AggThread(const vector<AggLeaf>& leaves)
+        : fields(new AggField[leaves.size()]) {
+        for (size_t i = 0; i < leaves.size(); i++) {
+            fields[i].min.store(0, memory_order_relaxed);
+            fields[i].max.store(0, memory_order_relaxed);
+            fields[i].sum.store(0, memory_order_relaxed);
+            if (leaves[i].kind == AGG_ENUM) {
+                fields[i].freq = new Counter[leaves[i].enums.size() + 1];
+            }
+        }
+    }
+
+    AggField* fields;
+};
+
+struct AggSite {
+    string name;
+    string file;
+    int line;
+    string type;
+    // p() passes a pointer to the value.
+    bool deref;
+    // Bytes read through a deref'ed pointer.
+    int size;
+    vector<AggLeaf> leaves;
+    // Never freed, as threads may exit before a report.
+    vector<AggThread*> threads;
+};
+
+static mutex agg_mu;
+static map<pair<pair<string, int>, string>, AggSite*> agg_sites;
+static double agg_interval;
+static atomic<double> agg_next_report;
+
+static void compile_leaves(DumpUnit* unit, const string& path, int offset,
+                           int nest, vector<AggLeaf>* leaves)
+{
+    DumpUnit* u = strip_unit(unit);
+    if (!u || (int)leaves->size() >= AGG_MAX_LEAVES) return;
+
+    AggLeaf leaf;
+    leaf.path = path;
+    leaf.offset = offset;
+    leaf.size = u->size();
+    leaf.bitfield.bits = 0;
+    if (DumpPrim* prim = dynamic_cast<DumpPrim*>(u)) {
+        PrimClass k = prim->klass();
+        if (k == PRIM_FLOAT) leaf.kind = AGG_FLOAT;
+        else if (k == PRIM_SIGNED) leaf.kind = AGG_SIGNED;
+        else if (k == PRIM_CHAR &&
+                 prim->name().find("unsigned") == string::npos) {
+            leaf.kind = AGG_SIGNED;
+        }
+        else leaf.kind = AGG_UNSIGNED;
+        if (leaf.size > 0 && leaf.size <= 16) leaves->push_back(leaf);
+    }
+    else if (DumpEnum* en = dynamic_cast<DumpEnum*>(u)) {
+        leaf.kind = AGG_ENUM;
+        leaf.enums.assign(en->enums().begin(), en->enums().end());
+        leaves->push_back(leaf);
+    }
+    else if (DumpStruct* st = dynamic_cast<DumpStruct*>(u)) {
+        if (nest > DUMP_RECURSIVE_LEVEL*2) return;
+        const vector<DumpStruct::Member>& mems = st->members();
+        for (size_t i = 0; i < mems.size(); i++) {
+            if (mems[i].loc < 0) continue;
+            // Members of base classes are shown as if they were ours.
+            string p = path;
+            if (mems[i].name != "<inherit>") {
+                p += (p.empty() ? "" : ".") + mems[i].name;
+            }
+            size_t first = leaves->size();
+            compile_leaves(find_unit(mems[i].type), p, offset + mems[i].loc,
+                           nest + 1, leaves);
+            if (mems[i].bits && leaves->size() == first + 1) {
+                leaves->back().size = mems[i].unit;
+                leaves->back().bitfield = mems[i];
+            }
+        }
+    }
+    else if (DumpArray* a = dynamic_cast<DumpArray*>(u)) {
+        DumpUnit* e = find_unit(a->type());
+        int size = e ? e->size() : -1;
+        if (size <= 0) return;
+        for (int i = 0; i < a->count() && i < AGG_MAX_ARRAY; i++) {
+            char buf[16];
+            sprintf(buf, "[%d]", i);
+            compile_leaves(e, path + buf, offset + i * size, nest, leaves);
+        }
+    }
+    // Pointers and functions say nothing about a distribution.
+}
+
+static double read_leaf(const AggLeaf& l, const char* p) {
+    if (l.bitfield.bits) {
+        bool sign = l.kind == AGG_SIGNED;
+        unsigned long long v = DumpStruct::loadBits(l.bitfield, p, sign);
+        return sign ? (double)(long long)v : (double)v;
+    }
+    if (l.kind == AGG_FLOAT) {
+        if (l.size == sizeof(float)) return *(const float*)p;
+        if (l.size == sizeof(double)) return *(const double*)p;
+        return *(const long double*)p;
+    }
+    unsigned long long v = 0;
+    memcpy(&v, p, min(l.size, 8));
+    if (l.kind == AGG_UNSIGNED || l.size >= 8) {
+        return l.kind == AGG_UNSIGNED ? (double)v : (double)(long long)v;
+    }
+    // Sign extend.
+    int shift = 64 - l.size * 8;
+    return (double)((long long)(v << shift) >> shift);
+}
+
+static int agg_bucket(double v) {
+    double a = v < 0 ? -v : v;
+    if (a < 1) return AGG_ZERO_BUCKET;
+    int e = min(ilogb(a), 63);
+    return v < 0 ? AGG_ZERO_BUCKET - 1 - e : AGG_ZERO_BUCKET + 1 + e;
+}
+
+static int agg_enum_index(const AggLeaf& l, int v) {
+    vector<pair<int, string> >::const_iterator ite =
+        lower_bound(l.enums.begin(), l.enums.end(), make_pair(v, string()));
+    if (ite != l.enums.end() && ite->first == v) {
+        return ite - l.enums.begin();
+    }
+    return l.enums.size();
+}
+
+static void agg_update(const AggLeaf& l, AggField* f, const char* p) {
+    if (l.kind == AGG_ENUM) {
+        // Read with the enum's own size, then try both extensions of a
+        // narrow value as its underlying type may be unsigned.
+        int bits = l.bitfield.bits ? l.bitfield.bits : min(l.size, 4) * 8;
+        unsigned int u = (unsigned int)(long long)read_leaf(l, p);
+        if (bits < 32) u &= (1U << bits) - 1;
+        int shift = 32 - bits;
+        int idx = agg_enum_index(l, (int)(u << shift) >> shift);
+        if (idx == (int)l.enums.size() && bits < 32) {
+            idx = agg_enum_index(l, u);
+        }
+        f->freq[idx].add(1);
+        f->count.add(1);
+        return;
+    }
+
+    double v = read_leaf(l, p);
+    if (f->count.get() == 0 || v < f->min.load(memory_order_relaxed)) {
+        f->min.store(v, memory_order_relaxed);
+    }
+    if (f->count.get() == 0 || v > f->max.load(memory_order_relaxed)) {
+        f->max.store(v, memory_order_relaxed);
+    }
+    f->sum.store(f->sum.load(memory_order_relaxed) + v, memory_order_relaxed);
+    if (v == v) f->buckets[agg_bucket(v)].add(1);
+    f->count.add(1);
+}
+
+static AggSite* agg_site(const char* name, const char* file, int line) {
+    RegistryLock reg;
+    lock_guard<mutex> lock(agg_mu);
+    AggSite*& site = agg_sites[make_pair(make_pair(string(file), line),
+                                         string(name))];
+    if (site) return site;
+
+    site = new AggSite();
+    site->name = name;
+    site->file = file;
+    site->line = line;
+    site->deref = false;
+    site->size = 0;
+    map<string, vector<variable> >::iterator vals = find_variables(file);
+    DumpUnit* u = 0;
+    if (vals != variables.end()) {
+        u = find_unit(site_type(vals->second, file, line));
+    }
+    if (DumpPtr* ptr = dynamic_cast<DumpPtr*>(strip_unit(u))) {
+        u = find_unit(ptr->type());
+        site->deref = true;
+    }
+    if (!u) {
+        tstats().lookup_misses.add(1);
+        site->type = "???";
+        return site;
+    }
+    pin_unit(u);
+    site->type = u->name();
+    site->size = u->size();
+    compile_leaves(u, "", 0, 0, &site->leaves);
+    // A bare primitive is its own single leaf.
+    if (site->leaves.size() == 1 && site->leaves[0].path.empty()) {
+        site->leaves[0].path = name;
+    }
+    return site;
+}
+
+static void aggregate_s(void* p, const char* name, const char* file,
+                        int line)
+{
+    typedef pair<pair<const char*, int>, const char*> SiteKey;
+    typedef map<SiteKey, pair<AggSite*, AggThread*> > SiteCache;
+    static thread_local SiteCache cache;
+
+    // Both strings come from p() and so are stable for a site.
+    SiteKey key(make_pair(file, line), name);
+    SiteCache::iterator found = cache.find(key);
+    if (found == cache.end()) {
+        AggSite* site = agg_site(name, file, line);
+        AggThread* th = new AggThread(site->leaves);
+        {
+            lock_guard<mutex> lock(agg_mu);
+            site->threads.push_back(th);
+        }
+        found = cache.insert(make_pair(key, make_pair(site, th))).first;
+    }
+
+    const AggSite* site = found->second.first;
+    const vector<AggLeaf>& leaves = site->leaves;
+    AggField* fields = found->second.second->fields;
+    if (site->deref) {
+        p = *(void**)p;
+        // Null or dangling pointers are counted, not sampled.
+        if (!is_readable_range(p, site->size)) {
+            tstats().unreadable_ptrs.add(1);
+            return;
+        }
+    }
+    for (size_t i = 0; i < leaves.size(); i++) {
+        agg_update(leaves[i], &fields[i], (const char*)p + leaves[i].offset);
+    }
+
+    if (agg_interval > 0) {
+        double now = now_sec();
+        double next = agg_next_report.load(memory_order_relaxed);
+        if (now >= next &&
+            agg_next_report.compare_exchange_strong(next, now + agg_interval))
+        {
+            dump_aggregate_report();
+        }
+    }
+}
+
+static void agg_report_site(const AggSite* site) {
+    emit("%s at %s:%d : %s\n",
+         site->name.c_str(), site->file.c_str(), site->line,
+         site->type.c_str());
+    for (size_t i = 0; i < site->leaves.size(); i++) {
+        const AggLeaf& l = site->leaves[i];
+        unsigned long long count = 0;
+        double mn = 0, mx = 0, sum = 0;
+        unsigned long long buckets[AGG_BUCKETS] = {};
+        vector<unsigned long long> freq(l.enums.size() + 1);
+        for (size_t t = 0; t < site->threads.size(); t++) {
+            const AggField& f = site->threads[t]->fields[i];
+            unsigned long long c = f.count.get();
+            if (!c) continue;
+            double fmn = f.min.load(memory_order_relaxed);
+            double fmx = f.max.load(memory_order_relaxed);
+            if (!count || fmn < mn) mn = fmn;
+            if (!count || fmx > mx) mx = fmx;
+            count += c;
+            sum += f.sum.load(memory_order_relaxed);
+            for (int b = 0; b < AGG_BUCKETS; b++) {
+                buckets[b] += f.buckets[b].get();
+            }
+            for (size_t e = 0; f.freq && e < freq.size(); e++) {
+                freq[e] += f.freq[e].get();
+            }
+        }
+
+        emit("  %s: count=%llu", l.path.c_str(), count);
+        if (l.kind == AGG_ENUM) {
+            for (size_t e = 0; e < l.enums.size(); e++) {
+                if (freq[e]) {
+                    emit(" %s=%llu", l.enums[e].second.c_str(), freq[e]);
+                }
+            }
+            if (freq.back()) emit(" <unknown>=%llu", freq.back());
+            emit("\n");
+            continue;
+        }
+        if (count) {
+            emit(" min=%.17g max=%.17g mean=%.17g", mn, mx, sum / count);
+        }
+        emit("\n");
+        if (!count) continue;
+        emit("   ");
+        for (int b = 0; b < AGG_BUCKETS; b++) {
+            if (!buckets[b]) continue;
+            if (b == AGG_ZERO_BUCKET) {
+                emit(" (-1,1):%llu", buckets[b]);
+            }
+            else if (b > AGG_ZERO_BUCKET) {
+                int e = b - AGG_ZERO_BUCKET - 1;
+                emit(" [%.0f,%.0f):%llu", ldexp(1, e), ldexp(1, e + 1),
+                     buckets[b]);
+            }
+            else {
+                int e = AGG_ZERO_BUCKET - 1 - b;
+                emit(" (%.0f,%.0f]:%llu", -ldexp(1, e + 1), -ldexp(1, e),
+                     buckets[b]);
+            }
+        }
+        emit("\n");
+    }
+}
+
+extern "C" void dump_aggregate(int enable, double interval_sec) {
+    agg_interval = enable ? interval_sec : 0;
+    agg_next_report.store(now_sec() + agg_interval);
+    aggregating.store(enable != 0);
+}
+
+extern "C" void dump_aggregate_report() {
+    lock_guard<mutex> lock(agg_mu);
+    for (map<pair<pair<string, int>, string>, AggSite*>::const_iterator
+             ite = agg_sites.begin(); ite != agg_sites.end(); ++ite)
+    {
+        agg_report_site(ite->second);
+    }
+}
+
+// Log mode: p() and pv() copy the raw bytes of the value, and of what its
+// pointers point to up to a budget, into a memory mapped file instead of
+// formatting them.  dump_log_decode formats the records later with the
+// debug info of the binary.  Each thread fills a chunk of the file of its
+// own, so only taking a chunk is shared.  The first record of a site in
+// a log defines the site's id.
+
+static const char LOG_MAGIC[8] = { 'D', 'U', 'M', 'P', 'L', 'O', 'G', 0 };
+static const uint32_t LOG_VERSION = 1;
+static const uint32_t LOG_CHUNK = 64 * 1024;
+static const uint32_t LOG_SITE_DEF = 0x80000000;
+static const int LOG_MAX_POINTERS = 64;
+
+struct LogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t base_addr;
+    uint64_t file_size;
+    // Bytes of chunks taken after the header, and records which did not
+    // fit.  Both are updated atomically.
+    uint64_t tail;
+    uint64_t dropped;
+};
+
+// Followed by `bytes' bytes of the value and `pointees' LogPointee, each
+// padded to 8 bytes.  A site definition has LOG_SITE_DEF in `site', the
+// line in `addr' and the name and the file as C strings.  A record larger
+// than a chunk takes chunks of its own; otherwise a zero `size' or the
+// end of the chunk ends the records of a chunk.
+struct LogRecord {
+    uint32_t size;
+    uint32_t site;
+    uint64_t time_ns;
+    uint64_t addr;
+    uint32_t bytes;
+    uint32_t pointees;
+};
+
+// Followed by `bytes' bytes read from `addr'.
+struct LogPointee {
+    uint64_t addr;
+    uint32_t bytes;
+    uint32_t pad;
+};
+
+struct LogPointer {
+    int offset;
+    int size;
+};
+
+struct LogSite {
+    uint32_t id;
+    // Bytes of the value, or -1 if its type is unknown.
+    int size;
+    // If the value is a pointer, as it is for p(), the bytes it points
+    // to, which are copied whatever the budget.  `pointers' are then in
+    // those rather than in the value.  Only strings may be shorter.
+    int top;
+    bool top_str;
+    int budget;
+    vector<LogPointer> pointers;
+    size_t max_record;
+};
+
+// The chunk this thread is filling.  A log is never unmapped, as other
+// threads may be in the middle of a record, so `log' tells logs apart.
+struct LogChunk {
+    const LogHeader* log;
+    char* cur;
+    char* end;
+};
+
+static mutex log_mu;
+static size_t log_size;
+static int log_budget;
+static uint32_t log_next_site;
+static map<pair<pair<string, int>, string>, LogSite*> log_sites;
+static thread_local LogChunk log_chunk;
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+// Pointers in a value, directly or in members, and how many bytes of
+// what they point to are worth copying.
+static void compile_pointers(DumpUnit* unit, int offset, int nest,
+                             vector<LogPointer>* pointers)
+{
+    DumpUnit* u = strip_unit(unit);
+    if (!u || (int)pointers->size() >= LOG_MAX_POINTERS) return;
+
+    if (DumpPtr* ptr = dynamic_cast<DumpPtr*>(u)) {
+        DumpUnit* t = find_unit(ptr->type());
+        if (!t || dynamic_cast<DumpFunc*>(t)) return;
+        LogPointer lp;
+        lp.offset = offset;
+        if (t->name() == "char") {
+            lp.size = string_limit.load(memory_order_relaxed) + 1;
+        }
+        else {
+            lp.size = t->size();
+        }
+        if (lp.size > 0) pointers->push_back(lp);
+    }
+    else if (DumpStruct* st = dynamic_cast<DumpStruct*>(u)) {
+        if (nest > DUMP_RECURSIVE_LEVEL*2) return;
+        const vector<DumpStruct::Member>& mems = st->members();
+        for (size_t i = 0; i < mems.size(); i++) {
+            if (mems[i].loc < 0) continue;
+            compile_pointers(find_unit(mems[i].type), offset + mems[i].loc,
+                             nest + 1, pointers);
+        }
+    }
+    // Pointers in arrays are not followed.
+}
+
+// Room for `len' bytes in this thread's chunk, or in chunks of its own
+// for a large record.  Returns 0 if the log is full.
+static char* log_reserve(LogHeader* h, size_t len) {
+    LogChunk& c = log_chunk;
+    if (c.log != h) {
+        c.log = h;
+        c.cur = c.end = 0;
+    }
+    if (len <= (size_t)(c.end - c.cur)) return c.cur;
+
+    uint64_t span = (len + LOG_CHUNK - 1) / LOG_CHUNK * LOG_CHUNK;
+    uint64_t off = __atomic_fetch_add(&h->tail, span, __ATOMIC_RELAXED);
+    if (off + span > h->file_size - sizeof(LogHeader)) {
+        __atomic_fetch_add(&h->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    char* p = (char*)(h + 1) + off;
+    if (span == LOG_CHUNK) {
+        c.cur = p;
+        c.end = p + span;
+    }
+    return p;
+}
+
+static void log_commit(LogRecord* r, size_t len) {
+    LogChunk& c = log_chunk;
+    if ((char*)r == c.cur) c.cur += len;
+    // Set last, so that a record cut short by a crash ends the chunk.
+    __atomic_store_n(&r->size, (uint32_t)len, __ATOMIC_RELEASE);
+}
+
+static void log_define(LogHeader* h, const LogSite* site, const char* name,
+                       const char* file, int line)
+{
+    size_t name_len = strlen(name) + 1;
+    size_t file_len = strlen(file) + 1;
+    size_t len = sizeof(LogRecord) + align8(name_len + file_len);
+    LogRecord* r = (LogRecord*)log_reserve(h, len);
+    if (!r) return;
+    r->site = LOG_SITE_DEF | site->id;
+    r->time_ns = 0;
+    r->addr = line;
+    r->bytes = name_len + file_len;
+    r->pointees = 0;
+    memcpy(r + 1, name, name_len);
+    memcpy((char*)(r + 1) + name_len, file, file_len);
+    log_commit(r, len);
+}
+
+static LogSite* log_site(LogHeader* h, const char* name, const char* file,
+                         int line)
+{
+    RegistryLock reg;
+    lock_guard<mutex> lock(log_mu);
+    // Closed or opened again since the caller looked.
+    if (log_header.load() != h) return 0;
+    LogSite*& site = log_sites[make_pair(make_pair(string(file), line),
+                                         string(name))];
+    if (site) return site;
+
+    site = new LogSite();
+    site->id = log_next_site++;
+    site->size = -1;
+    site->top = 0;
+    site->top_str = false;
+    site->budget = log_budget;
+    map<string, vector<variable> >::iterator vals = find_variables(file);
+    DumpUnit* u = 0;
+    if (vals != variables.end()) {
+        u = find_unit(site_type(vals->second, file, line));
+    }
+    if (u && u->size() > 0) {
+        site->size = u->size();
+        compile_pointers(u, 0, 0, &site->pointers);
+    }
+    else {
+        tstats().lookup_misses.add(1);
+    }
+    DumpPtr* ptr = dynamic_cast<DumpPtr*>(strip_unit(u));
+    if (ptr && !site->pointers.empty()) {
+        site->top = site->pointers[0].size;
+        site->pointers.clear();
+        DumpUnit* t = find_unit(ptr->type());
+        site->top_str = t->name() == "char";
+        if (!site->top_str) compile_pointers(t, 0, 0, &site->pointers);
+    }
+    if (site->budget <= 0) site->pointers.clear();
+
+    site->max_record = sizeof(LogRecord) + align8(max(site->size, 0));
+    if (site->top) {
+        site->max_record += sizeof(LogPointee) + align8(site->top);
+    }
+    for (size_t i = 0; i < site->pointers.size(); i++) {
+        site->max_record += sizeof(LogPointee) +
+            align8(min(site->pointers[i].size, site->budget));
+    }
+    log_define(h, site, name, file, line);
+    return site;
+}
+
+static void log_s(LogHeader* h, void* p, const char* name, const char* file,
+                  int line)
+{
+    typedef pair<pair<const char*, int>, const char*> SiteKey;
+    typedef map<SiteKey, const LogSite*> SiteCache;
+    static thread_local SiteCache cache;
+    static thread_local const LogHeader* cache_log;
+
+    if (cache_log != h) {
+        cache.clear();
+        cache_log = h;
+    }
+    // Both strings come from p() and so are stable for a site.
+    SiteKey key(make_pair(file, line), name);
+    SiteCache::iterator found = cache.find(key);
+    if (found == cache.end()) {
+        const LogSite* site = log_site(h, name, file, line);
+        if (!site) return;
+        found = cache.insert(make_pair(key, site)).first;
+    }
+
+    const LogSite* site = found->second;
+    if (site->size < 0) return;
+    LogRecord* r = (LogRecord*)log_reserve(h, site->max_record);
+    if (!r) return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    r->site = site->id;
+    r->time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    r->addr = (uintptr_t)p;
+    r->bytes = site->size;
+    r->pointees = 0;
+    char* out = (char*)(r + 1);
+    memcpy(out, p, site->size);
+    out += align8(site->size);
+
+    // Further pointers are read from the copy of what the value points to.
+    // The value is live, but what it points to may be dangling, so it is
+    // read with a bound.  Only a string may be cut short.
+    const char* base = (const char*)p;
+    if (site->top) {
+        void* target = *(void**)p;
+        LogPointee* pe = (LogPointee*)out;
+        size_t got = target ? read_bounded(pe + 1, target, site->top) : 0;
+        if (!site->top_str && got < (size_t)site->top) {
+            if (target) tstats().unreadable_ptrs.add(1);
+            got = 0;
+        }
+        if (got) {
+            pe->addr = (uintptr_t)target;
+            pe->bytes = got;
+            pe->pad = 0;
+            out += sizeof(LogPointee) + align8(got);
+            r->pointees++;
+        }
+        base = got == (size_t)site->top ? (const char*)(pe + 1) : 0;
+    }
+
+    int budget = site->budget;
+    for (size_t i = 0; base && i < site->pointers.size() && budget > 0; i++) {
+        const LogPointer& lp = site->pointers[i];
+        void* target;
+        memcpy(&target, base + lp.offset, sizeof(target));
+        if (!target) continue;
+        LogPointee* pe = (LogPointee*)out;
+        size_t got = read_bounded(pe + 1, target, min(lp.size, budget));
+        if (!got) continue;
+        pe->addr = (uintptr_t)target;
+        pe->bytes = got;
+        pe->pad = 0;
+        out += sizeof(LogPointee) + align8(got);
+        budget -= got;
+        r->pointees++;
+    }
+    log_commit(r, out - (char*)r);
+}
+
+extern "C" int dump_log_open(const char* path, unsigned long long bytes,
+                             int pointee_budget)
+{
+    lock_guard<mutex> lock(log_mu);
+    if (log_header.load()) {
+        fprintf(stderr, "a dump log is already open\n");
+        return 1;
+    }
+    uint64_t chunks = bytes > sizeof(LogHeader) ?
+        (bytes - sizeof(LogHeader)) / LOG_CHUNK : 0;
+    if (!chunks) {
+        fprintf(stderr, "a dump log needs more than %u bytes\n", LOG_CHUNK);
+        return 1;
+    }
+    size_t size = sizeof(LogHeader) + chunks * LOG_CHUNK;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    if (ftruncate(fd, size)) {
+        perror("ftruncate(2) failed");
+        close(fd);
+        return 1;
+    }
+    void* image = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        perror("mmap(2) failed");
+        return 1;
+    }
+
+    LogHeader* h = (LogHeader*)image;
+    memcpy(h->magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+    h->version = LOG_VERSION;
+    h->chunk_size = LOG_CHUNK;
+    h->base_addr = base_addr;
+    h->file_size = size;
+    h->tail = 0;
+    h->dropped = 0;
+    log_size = size;
+    log_budget = max(pointee_budget, 0);
+    // Sites in use by other threads are never freed.
+    log_sites.clear();
+    log_next_site = 0;
+    log_header.store(h);
+    return 0;
+}
+
+extern "C" void dump_log_close(void) {
+    lock_guard<mutex> lock(log_mu);
+    LogHeader* h = log_header.exchange(0);
+    if (h) msync(h, log_size, MS_ASYNC);
+}
+
+struct LogDef {
+    string name;
+    string file;
+    int line;
+    DumpUnit* unit;
+};
+
+// Checks that a record of the value and its pointees fits in its size,
+// and collects them.
+static bool log_image_of(const LogRecord* r, MemImage* image) {
+    size_t off = sizeof(LogRecord) + align8(r->bytes);
+    if (r->bytes > r->size || off > r->size) return false;
+    MemImage::Block b = { (uintptr_t)r->addr, r->bytes, (char*)(r + 1) };
+    image->add(b);
+    for (uint32_t i = 0; i < r->pointees; i++) {
+        if (off + sizeof(LogPointee) > r->size) return false;
+        const LogPointee* pe = (const LogPointee*)((const char*)r + off);
+        off += sizeof(LogPointee) + align8(pe->bytes);
+        if (pe->bytes > r->size || off > r->size) return false;
+        MemImage::Block pb = { (uintptr_t)pe->addr, pe->bytes,
+                               (char*)(pe + 1) };
+        image->add(pb);
+    }
+    return true;
+}
+
+static void log_print(const LogRecord* r, const LogDef& def) {
+    emit("[%llu.%09llu] %s:%d ",
+         (unsigned long long)(r->time_ns / 1000000000),
+         (unsigned long long)(r->time_ns % 1000000000),
+         def.file.c_str(), def.line);
+    if (!def.unit) {
+        emit("cannot find type of %s\n", def.name.c_str());
+        return;
+    }
+    MemImage image;
+    if (!log_image_of(r, &image)) {
+        emit("%s = <broken record>\n", def.name.c_str());
+        return;
+    }
+
+    disp_ptrs.clear();
+    ImageScope scope(&image);
+    emit("%s = ", def.name.c_str());
+    def.unit->dump(image.blocks[0].copy);
+    emit(" : %s\n", def.unit->name().c_str());
+}
+
+extern "C" int dump_log_decode(const char* binary, const char* log_path) {
+    int fd = open(log_path, O_RDONLY);
+    if (fd < 0) {
+        perror(log_path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(LogHeader)) {
+        fprintf(stderr, "%s is not a dump log\n", log_path);
+        close(fd);
+        return 1;
+    }
+    size_t size = st.st_size;
+    char* image = (char*)mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        perror("mmap(2) failed");
+        return 1;
+    }
+    const LogHeader* h = (const LogHeader*)image;
+    if (memcmp(h->magic, LOG_MAGIC, sizeof(LOG_MAGIC)) ||
+        h->version != LOG_VERSION || h->chunk_size != LOG_CHUNK ||
+        h->file_size != size)
+    {
+        fprintf(stderr, "%s is not a dump log of this version\n", log_path);
+        munmap(image, size);
+        return 1;
+    }
+    if (dump_open(binary, (void*)(uintptr_t)h->base_addr)) {
+        munmap(image, size);
+        return 1;
+    }
+    RegistryLock reg;
+
+    // Chunks were taken by threads in any order, so gather the records
+    // and sort them by time.
+    const char* chunks = (const char*)(h + 1);
+    uint64_t used = min(h->tail, (uint64_t)(size - sizeof(LogHeader)));
+    vector<pair<uint64_t, const LogRecord*> > records;
+    map<uint32_t, LogDef> defs;
+    uint64_t off = 0;
+    while (off < used) {
+        const LogRecord* r = (const LogRecord*)(chunks + off);
+        uint64_t rest = LOG_CHUNK - off % LOG_CHUNK;
+        if (rest < sizeof(LogRecord) || r->size < sizeof(LogRecord) ||
+            r->size % 8 || r->size > used - off ||
+            (r->size > rest && rest != LOG_CHUNK))
+        {
+            off += rest;
+            continue;
+        }
+        off += r->size;
+        if (r->size > rest) {
+            off = (off + LOG_CHUNK - 1) / LOG_CHUNK * LOG_CHUNK;
+        }
+
+        if (!(r->site & LOG_SITE_DEF)) {
+            records.push_back(make_pair(r->time_ns, r));
+            continue;
+        }
+        const char* name = (const char*)(r + 1);
+        size_t len = min((size_t)r->bytes, r->size - sizeof(LogRecord));
+        size_t name_len = strnlen(name, len);
+        if (name_len == len) continue;
+        LogDef& def = defs[r->site & ~LOG_SITE_DEF];
+        def.name = name;
+        def.file.assign(name + name_len + 1,
+                        strnlen(name + name_len + 1, len - name_len - 1));
+        def.line = r->addr;
+        map<string, vector<variable> >::iterator vals =
+            find_variables(def.file.c_str());
+        def.unit = 0;
+        if (vals != variables.end()) {
+            def.unit = find_unit(site_type(vals->second, def.file.c_str(),
+                                           def.line));
+        }
+    }
+    sort(records.begin(), records.end());
+
+    for (size_t i = 0; i < records.size(); i++) {
+        map<uint32_t, LogDef>::const_iterator def =
+            defs.find(records[i].second->site);
+        if (def == defs.end()) continue;
+        log_print(records[i].second, def->second);
+    }
+    if (h->dropped) {
+        emit("%llu records did not fit in %s\n",
+             (unsigned long long)h->dropped, log_path);
+    }
+    munmap(image, size);
+    return 0;
+}
+
+// Parallel mode: the members of the root struct are formatted as chunks
+// by worker threads into their own buffers and written out in order.
+// Whether a pointer was "previously shown" depends on earlier chunks, so
+// each chunk guesses that only the root was shown before it.  A chunk
+// which looked for a struct that an earlier chunk turned out to show is
+// formatted again in order, which keeps the output the same as dump().
+
+struct DumpChunk {
+    size_t member;
+    string out;
+    vector<void*> inserted;
+    vector<void*> missed;
+};
+
+// Each worker takes chunks from the front of its own deque and steals
+// from the back of others' when it runs dry.
+struct ChunkQueue {
+    mutex mu;
+    deque<size_t> chunks;
+};
+
+static bool take_chunk(vector<ChunkQueue>& queues, size_t self,
+                       size_t* chunk)
+{
+    {
+        lock_guard<mutex> lock(queues[self].mu);
+        if (!queues[self].chunks.empty()) {
+            *chunk = queues[self].chunks.front();
+            queues[self].chunks.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+        ChunkQueue& victim = queues[(self + i) % queues.size()];
+        lock_guard<mutex> lock(victim.mu);
+        if (!victim.chunks.empty()) {
+            *chunk = victim.chunks.back();
+            victim.chunks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+static void format_chunk(DumpStruct* st, void* p, DumpChunk* chunk,
+                         const set<void*>& shown, bool record)
+{
+    disp_ptrs.clear();
+    disp_ptrs.shown = shown;
+    disp_ptrs.record = record;
+    nest_level = 2;
+    emit_buf = &chunk->out;
+    chunk->out.clear();
+
+    st->dumpMember(chunk->member, p);
+
+    emit_buf = 0;
+    nest_level = 0;
+    chunk->inserted.swap(disp_ptrs.inserted);
+    chunk->missed.swap(disp_ptrs.missed);
+    disp_ptrs.record = false;
+    disp_ptrs.clear();
+}
+
+static void chunk_worker(DumpStruct* st, void* p, vector<DumpChunk>* chunks,
+                         vector<ChunkQueue>* queues, size_t self)
+{
+    set<void*> root;
+    root.insert(p);
+    size_t c;
+    while (take_chunk(*queues, self, &c)) {
+        format_chunk(st, p, &(*chunks)[c], root, true);
+    }
+}
+
+extern "C" void dump_parallel(void* p, const char* type, int threads) {
+    RegistryLock reg;
+    DumpUnit* u = find_type(type);
+    DumpStruct* st = dynamic_cast<DumpStruct*>(strip_unit(u));
+    if (threads <= 0) threads = thread::hardware_concurrency();
+    // Workers would read evicted units behind the registry lock.
+    if (!st || threads <= 1 || st->members().size() < 2 || memory_budget ||
+        u->formatter || st->formatter)
+    {
+        dump(p, type);
+        return;
+    }
+
+    tstats().dump_calls.add(1);
+    size_t num = st->members().size();
+    vector<DumpChunk> chunks(num);
+    vector<ChunkQueue> queues(min((size_t)threads, num));
+    for (size_t i = 0; i < num; i++) {
+        chunks[i].member = i;
+        // Contiguous ranges, so that neighbours share a worker.
+        queues[i * queues.size() / num].chunks.push_back(i);
+    }
+
+    vector<thread> workers;
+    for (size_t i = 1; i < queues.size(); i++) {
+        workers.push_back(thread(chunk_worker, st, p, &chunks, &queues, i));
+    }
+    chunk_worker(st, p, &chunks, &queues, 0);
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+    set<void*> shown;
+    shown.insert(p);
+    size_t bytes = 0;
+    fputs("{\n", stdout);
+    bytes += 2;
+    for (size_t i = 0; i < num; i++) {
+        DumpChunk& c = chunks[i];
+        bool stale = false;
+        for (size_t j = 0; j < c.missed.size() && !stale; j++) {
+            stale = shown.count(c.missed[j]) != 0;
+        }
+        if (stale) {
+            format_chunk(st, p, &c, shown, true);
+        }
+        shown.insert(c.inserted.begin(), c.inserted.end());
+        fwrite(c.out.data(), 1, c.out.size(), stdout);
+        bytes += c.out.size();
+        string().swap(c.out);
+    }
+    fputs("}\n", stdout);
+    bytes += 2;
+    tstats().bytes_emitted.add(bytes);
+}
+
+extern "C" int dump_set_string_limit(int bytes) {
+    if (bytes > 0) return string_limit.exchange(bytes);
+    return string_limit.load();
+}
+
+template <class T>
+static void write_table(FILE* fp, IndexHeader* h, IndexTable t,
+                        const vector<T>& v)
+{
+    // Keep every table aligned for direct access.
+    long pos = ftell(fp);
+    while (pos % 8) {
+        fputc(0, fp);
+        pos++;
+    }
+    h->offsets[t] = pos;
+    h->counts[t] = v.size();
+    if (!v.empty()) fwrite(&v[0], sizeof(T), v.size(), fp);
+}
+
+extern "C" int dump_write_index(const char* file_name) {
+    if (memory_budget) {
+        fprintf(stderr, "dump_write_index needs all units loaded\n");
+        return 1;
+    }
+    RegistryLock reg;
+    load_all_splits();
+
+    IndexWriter w;
+    map<DumpUnit*, int32_t> index;
+    for (map<int, DumpUnit*>::const_iterator ite = id2unit.begin();
+         ite != id2unit.end(); ++ite)
+    {
+        DumpUnit* u = ite->second;
+        if (!u) continue;
+        if (!index.count(u)) {
+            IndexUnit rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.kind = unit_kind(u);
+            rec.id = u->id;
+            u->save(&w, &rec);
+            index[u] = w.units.size();
+            w.units.push_back(rec);
+        }
+        IndexPair p = { ite->first, index[u] };
+        w.ids.push_back(p);
+    }
+    for (map<int, int>::const_iterator ite = sig_alias.begin();
+         ite != sig_alias.end(); ++ite)
+    {
+        IndexPair p = { ite->first, ite->second };
+        w.aliases.push_back(p);
+    }
+    for (map<string, DumpUnit*>::const_iterator ite = types.begin();
+         ite != types.end(); ++ite)
+    {
+        map<DumpUnit*, int32_t>::const_iterator u = index.find(ite->second);
+        if (u == index.end()) continue;
+        IndexPair p = { (int32_t)w.str(ite->first), u->second };
+        w.types.push_back(p);
+    }
+    for (map<string, vector<variable> >::const_iterator ite =
+             variables.begin(); ite != variables.end(); ++ite)
+    {
+        for (size_t i = 0; i < ite->second.size(); i++) {
+            const variable& v = ite->second[i];
+            IndexVar iv;
+            iv.cu = w.str(ite->first);
+            iv.name = w.str(v.name);
+            iv.file = w.str(v.file);
+            iv.line = v.line;
+            iv.type = v.type;
+            w.vars.push_back(iv);
+        }
+    }
+    for (size_t i = 0; i < funcs.size(); i++) {
+        const func& f = funcs[i];
+        IndexFunc a;
+        a.low = (uintptr_t)f.low - base_addr;
+        a.high = (uintptr_t)f.high - base_addr;
+        a.name = w.str(f.name);
+        save_locations(&w, f.frame_base, &a.frame_first, &a.frame_count);
+        a.local_first = w.locals.size();
+        a.local_count = f.locals.size();
+        a.pad = 0;
+        for (size_t j = 0; j < f.locals.size(); j++) {
+            const local& l = f.locals[j];
+            IndexLocal il;
+            il.name = w.str(l.name);
+            il.type = l.type;
+            il.param = l.param;
+            il.pad = 0;
+            il.low = l.low ? (uintptr_t)l.low - base_addr : 0;
+            il.high = l.low ? (uintptr_t)l.high - base_addr : 0;
+            save_locations(&w, l.loc, &il.loc_first, &il.loc_count);
+            w.locals.push_back(il);
+        }
+        w.funcs.push_back(a);
+    }
+    for (map<string, global>::const_iterator ite = globals.begin();
+         ite != globals.end(); ++ite)
+    {
+        IndexGlobal g;
+        g.addr = (uintptr_t)ite->second.addr - base_addr;
+        g.name = w.str(ite->first);
+        g.type = ite->second.type;
+        w.globals.push_back(g);
+    }
+    for (size_t i = 0; i < vtables.size(); i++) {
+        IndexAddr a;
+        a.low = (uintptr_t)vtables[i].addr - base_addr;
+        a.high = 0;
+        a.name = w.str(vtables[i].name);
+        a.pad = 0;
+        w.vtables.push_back(a);
+    }
+
+    FILE* fp = fopen(file_name, "wb");
+    if (!fp) {
+        perror(file_name);
+        return 1;
+    }
+    IndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    h.version = INDEX_VERSION;
+    h.pointer_size = sizeof(void*);
+    fwrite(&h, sizeof(h), 1, fp);
+    write_table(fp, &h, IDX_UNITS, w.units);
+    write_table(fp, &h, IDX_IDS, w.ids);
+    write_table(fp, &h, IDX_ALIASES, w.aliases);
+    write_table(fp, &h, IDX_TYPES, w.types);
+    write_table(fp, &h, IDX_MEMBERS, w.members);
+    write_table(fp, &h, IDX_ENUMS, w.enums);
+    write_table(fp, &h, IDX_ARGS, w.args);
+    write_table(fp, &h, IDX_VARS, w.vars);
+    write_table(fp, &h, IDX_FUNCS, w.funcs);
+    write_table(fp, &h, IDX_VTABLES, w.vtables);
+    write_table(fp, &h, IDX_EXPRS, w.exprs);
+    write_table(fp, &h, IDX_LOCALS, w.locals);
+    write_table(fp, &h, IDX_LOCS, w.locs);
+    write_table(fp, &h, IDX_GLOBALS, w.globals);
+    write_table(fp, &h, IDX_STRINGS, w.strings);
+    rewind(fp);
+    fwrite(&h, sizeof(h), 1, fp);
+    if (fclose(fp)) {
+        perror(file_name);
+        return 1;
+    }
+    return 0;
+}
+
+// Writes C++ which prints structs as dump() does, with member offsets,
+// labels and calls for nested structs fixed at generation time.
+// Pointers are printed but not followed, so only null ones look the
+// same as in dump().
+class CodeGen {
+public:
+    CodeGen() : bits_(0), bits_sign_(false) {}
+
+    // Name of the function for `st', which is generated by run().
+    string func(DumpStruct* st) {
+        map<DumpStruct*, string>::iterator ite = names_.find(st);
+        if (ite != names_.end()) return ite->second;
+        string base = "dump_gen_";
+        const string n = st->name();
+        for (size_t i = 0; i < n.size(); i++) {
+            base += isalnum(n[i]) ? n[i] : '_';
+        }
+        string name = base;
+        for (int i = 2; !used_.insert(name).second; i++) {
+            ostringstream oss;
+            oss << base << "_" << i;
+            name = oss.str();
+        }
+        names_[st] = name;
+        queue_.push_back(st);
+        return name;
+    }
+
+    // Generates functions for the queued structs and the ones they hold.
+    string run() {
+        ostringstream decls;
+        for (size_t i = 0; i < queue_.size(); i++) {
+            DumpStruct* st = queue_[i];
+            string f = func(st);
+            decls << "static inline void " << f
+                  << "_(const char* p, int nest);\n";
+            o_ << "\n// " << st->name() << ", " << st->size() << " bytes\n";
+            o_ << "#define DUMP_GEN_SIZE_" << f.substr(9) << " "
+               << st->size() << "\n";
+            o_ << "static inline void " << f
+               << "_(const char* p, int nest) {\n";
+            o_ << "    (void)p;\n";
+            o_ << "    if (dump_format(p, \"" << st->name()
+               << "\")) return;\n";
+            o_ << "    if (nest > DUMP_RECURSIVE_LEVEL * 2) {\n"
+               << "        dump_printf(\"{ ... }\");\n"
+               << "        return;\n"
+               << "    }\n"
+               << "    dump_printf(\"{\\n\");\n";
+            const vector<DumpStruct::Member>& mems = st->members();
+            for (size_t m = 0; m < mems.size(); m++) {
+                // Static members have no location.
+                if (mems[m].loc == -1) continue;
+                DumpUnit* u = find_unit(mems[m].type);
+                o_ << "    dump_printf(\"%*s" << mems[m].name
+                   << " = \", nest + 2, \"\");\n";
+                if (!u || mems[m].loc < 0) {
+                    // Virtual bases are found through the vtable.
+                    o_ << "    dump_printf(\"???\\n\");\n";
+                    continue;
+                }
+                if (mems[m].bits) {
+                    bits_ = &mems[m];
+                    bits_sign_ = DumpStruct::signedBits(u);
+                }
+                value(u, mems[m].loc, "nest + 2", "    ");
+                o_ << "    dump_printf(\" : " << u->name();
+                if (bits_) o_ << ":" << (int)bits_->bits;
+                o_ << "\\n\");\n";
+                bits_ = 0;
+            }
+            o_ << "    dump_printf(\"%*s}\", nest, \"\");\n}\n";
+            o_ << "static inline void " << f
+               << "(const void* p, const char* label) {\n"
+               << "    dump_printf(\"%s = \", label);\n"
+               << "    " << f << "_((const char*)p, 0);\n"
+               << "    dump_printf(\" : " << st->name() << "\\n\");\n}\n";
+        }
+        return decls.str() + o_.str();
+    }
+
+private:
+    void load(const char* type, int off) {
+        if (bits_) {
+            static const char* const units[] = {
+                0, "uint8_t", "uint16_t", 0, "uint32_t", 0, 0, 0, "uint64_t"
+            };
+            o_ << "dump_gen_bits<" << type << ", " << units[bits_->unit]
+               << ">(p + " << off << ", " << (int)bits_->shift << ", "
+               << (int)bits_->bits << ", " << bits_sign_ << ")";
+            return;
+        }
+        o_ << "dump_gen_load<" << type << ">(p + " << off << ")";
+    }
+
+    // Statements printing the value of type `u' at `p + off'.
+    void value(DumpUnit* u, int off, const char* nest, const string& ind) {
+        // A formatter may be registered for any typedef on the way.
+        vector<string> typedefs;
+        for (DumpUnit* t = u; t && !bits_; ) {
+            if (DumpTypedef* td = dynamic_cast<DumpTypedef*>(t)) {
+                typedefs.push_back(td->name());
+                t = find_unit(td->type());
+            }
+            else if (DumpCv* cv = dynamic_cast<DumpCv*>(t)) {
+                t = find_unit(cv->type());
+            }
+            else {
+                break;
+            }
+        }
+        if (typedefs.empty()) {
+            stripped(strip_unit(u), off, nest, ind);
+            return;
+        }
+        o_ << ind << "if (";
+        for (size_t i = 0; i < typedefs.size(); i++) {
+            if (i) o_ << " &&\n" << ind << "    ";
+            o_ << "!dump_format(p + " << off << ", \"" << typedefs[i]
+               << "\")";
+        }
+        o_ << ") {\n";
+        stripped(strip_unit(u), off, nest, ind + "    ");
+        o_ << ind << "}\n";
+    }
+
+    void stripped(DumpUnit* t, int off, const char* nest,
+                  const string& ind) {
+        if (DumpStruct* st = dynamic_cast<DumpStruct*>(t)) {
+            o_ << ind << func(st) << "_(p + " << off << ", " << nest
+               << ");\n";
+        }
+        else if (DumpPrim* pr = dynamic_cast<DumpPrim*>(t)) {
+            prim(pr, off, ind);
+        }
+        else if (DumpEnum* en = dynamic_cast<DumpEnum*>(t)) {
+            o_ << ind << "switch (";
+            load("int", off);
+            o_ << ") {\n";
+            const map<int, string>& enums = en->enums();
+            for (map<int, string>::const_iterator ite = enums.begin();
+                 ite != enums.end(); ++ite)
+            {
+                o_ << ind << "case " << ite->first << ": dump_printf(\""
+                   << ite->second << "\"); break;\n";
+            }
+            o_ << ind << "}\n";
+        }
+        else if (DumpPtr* ptr = dynamic_cast<DumpPtr*>(t)) {
+            // Null pointers are shown as dump() shows them.
+            DumpUnit* target = find_unit(ptr->type());
+            o_ << ind << "if (";
+            load("void*", off);
+            o_ << ") dump_printf(\"%p\", ";
+            load("void*", off);
+            o_ << ");\n";
+            if (DumpFunc* f = dynamic_cast<DumpFunc*>(target)) {
+                o_ << ind << "else dump_printf(\"" << f->signature("???")
+                   << " [(nil)]\");\n";
+            }
+            else if (target) {
+                o_ << ind << "else dump_printf(\"(nil) <invalid ptr>\");\n";
+            }
+            else {
+                o_ << ind << "else dump_printf(\"(nil)\");\n";
+            }
+        }
+        else if (DumpArray* ar = dynamic_cast<DumpArray*>(t)) {
+            DumpUnit* e = find_unit(ar->type());
+            DumpPrim* ep = dynamic_cast<DumpPrim*>(e);
+            if (ar->count() < 1) {
+                o_ << ind << "dump_printf(\"{}\");\n";
+            }
+            else if (ep && e->name() == "char") {
+                o_ << ind << "dump_gen_chars(p + " << off << ", "
+                   << ar->count() << ");\n";
+            }
+            else if (e) {
+                o_ << ind << "dump_printf(\"{ \");\n";
+                value(e, off, nest, ind);
+                o_ << ind << "dump_printf(\""
+                   << (ar->count() > 1 ? ", ..." : "") << " }\");\n";
+            }
+            else {
+                o_ << ind << "dump_printf(\"{ ???, ... }\");\n";
+            }
+        }
+        else {
+            o_ << ind << "dump_printf(\"???\");\n";
+        }
+    }
+
+    void prim(DumpPrim* pr, int off, const string& ind) {
+        static const char* const ints[2][4] = {
+            { "int8_t", "int16_t", "int32_t", "int64_t" },
+            { "uint8_t", "uint16_t", "uint32_t", "uint64_t" },
+        };
+        int size = pr->size();
+        int log = size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 :
+            size == 8 ? 3 : -1;
+        switch (pr->klass()) {
+        case PRIM_BOOL:
+            o_ << ind << "dump_printf(\"%s\", ";
+            load("bool", off);
+            o_ << " ? \"true\" : \"false\");\n";
+            return;
+        case PRIM_CHAR:
+            o_ << ind << "dump_gen_char(";
+            load("unsigned char", off);
+            o_ << ");\n";
+            return;
+        case PRIM_FLOAT:
+            if (pr->complex() || (size != 4 && size != 8)) break;
+            o_ << ind << (size == 4 ? "dump_gen_float(" : "dump_gen_double(");
+            load(size == 4 ? "float" : "double", off);
+            o_ << ");\n";
+            return;
+        case PRIM_SIGNED:
+        case PRIM_UNSIGNED:
+            if (log < 0) break;
+            o_ << ind << "dump_printf(\""
+               << (pr->klass() == PRIM_SIGNED ? "%lld" : "%llu")
+               << " (0x%0" << size * 2 << "llx)\", ("
+               << (pr->klass() == PRIM_SIGNED ? "long long" :
+                   "unsigned long long") << ")";
+            load(ints[pr->klass() != PRIM_SIGNED][log], off);
+            o_ << ", (unsigned long long)";
+            load(ints[1][log], off);
+            o_ << ");\n";
+            return;
+        }
+        o_ << ind << "dump_printf(\"<" << pr->name() << ">\");\n";
+    }
+
+    // The bitfield whose value is being generated.
+    const DumpStruct::Member* bits_;
+    bool bits_sign_;
+    map<DumpStruct*, string> names_;
+    set<string> used_;
+    vector<DumpStruct*> queue_;
+    ostringstream o_;
+};
+
+// Char arrays in generated code, cut and escaped as dump_str does.
+static const char CODEGEN_CHARS[] =
+    "// Length of a well-formed UTF-8 sequence at `s', or 0.\n"
+    "static inline int dump_gen_utf8_len(const unsigned char* s, int n) {\n"
+    "    int len;\n"
+    "    if (s[0] >= 0xc2 && s[0] <= 0xdf) len = 2;\n"
+    "    else if (s[0] >= 0xe0 && s[0] <= 0xef) len = 3;\n"
+    "    else if (s[0] >= 0xf0 && s[0] <= 0xf4) len = 4;\n"
+    "    else return 0;\n"
+    "    if (n < len) return 0;\n"
+    "    for (int i = 1; i < len; i++) {\n"
+    "        if ((s[i] & 0xc0) != 0x80) return 0;\n"
+    "    }\n"
+    "    if (s[0] == 0xe0 && s[1] < 0xa0) return 0;\n"
+    "    if (s[0] == 0xed && s[1] >= 0xa0) return 0;\n"
+    "    if (s[0] == 0xf0 && s[1] < 0x90) return 0;\n"
+    "    if (s[0] == 0xf4 && s[1] >= 0x90) return 0;\n"
+    "    return len;\n"
+    "}\n"
+    "\n"
+    "// Cut at the string limit, with bytes which are neither printable\n"
+    "// nor UTF-8 as \\xNN.\n"
+    "static inline void dump_gen_chars(const char* p, int size) {\n"
+    "    const unsigned char* s = (const unsigned char*)p;\n"
+    "    int limit = dump_set_string_limit(0);\n"
+    "    int n = size < limit + 1 ? size : limit + 1;\n"
+    "    int len = (int)strnlen(p, n);\n"
+    "    bool whole = len < n || n == size;\n"
+    "    if (len > limit) len = limit;\n"
+    "    dump_printf(\"\\\"\");\n"
+    "    for (int i = 0; i < len; ) {\n"
+    "        int run = 0;\n"
+    "        while (i + run < len && s[i + run] >= 0x20 &&\n"
+    "               s[i + run] <= 0x7e) {\n"
+    "            run++;\n"
+    "        }\n"
+    "        if (!run) run = dump_gen_utf8_len(s + i, len - i);\n"
+    "        if (run) {\n"
+    "            dump_printf(\"%.*s\", run, p + i);\n"
+    "            i += run;\n"
+    "        }\n"
+    "        else {\n"
+    "            dump_printf(\"\\\\x%02x\", s[i++]);\n"
+    "        }\n"
+    "    }\n"
+    "    dump_printf(\"%s\\\" [%p]\", whole ? \"\" : \"...\", p);\n"
+    "}\n"
+    "\n";
+
+extern "C" int dump_write_code(const char* file_name,
+                               const char* const* types, int n) {
+    RegistryLock reg;
+    CodeGen gen;
+    for (int i = 0; i < n; i++) {
+        DumpStruct* st =
+            dynamic_cast<DumpStruct*>(strip_unit(find_type(types[i])));
+        if (!st) {
+            fprintf(stderr, "cannot find struct %s\n", types[i]);
+            return 1;
+        }
+        gen.func(st);
+    }
+
+    FILE* fp = fopen(file_name, "w");
+    if (!fp) {
+        perror(file_name);
+        return 1;
+    }
+    fprintf(fp,
+            "// Generated by dump_gen.  Do not edit.\n"
+            "// Unlike dump(), pointers other than null ones are printed as\n"
+            "// addresses and not followed.\n"
+            "\n"
+            "#pragma once\n"
+            "\n"
+            "#include <ctype.h>\n"
+            "#include <stdint.h>\n"
+            "#include <stdio.h>\n"
+            "#include <stdlib.h>\n"
+            "#include <string.h>\n"
+            "\n"
+            "#include \"dump.h\"\n"
+            "\n"
+            "template <class T>\n"
+            "static inline T dump_gen_load(const char* p) {\n"
+            "    T v;\n"
+            "    memcpy(&v, p, sizeof(v));\n"
+            "    return v;\n"
+            "}\n"
+            "\n"
+            "// A bitfield in the U at `p', widened to T.\n"
+            "template <class T, class U>\n"
+            "static inline T dump_gen_bits(const char* p, int shift, "
+            "int bits,\n"
+            "                              bool sign) {\n"
+            "    unsigned long long v = dump_gen_load<U>(p);\n"
+            "    v = v >> shift & (~0ULL >> (64 - bits));\n"
+            "    if (sign && bits < 64 && (v >> (bits - 1) & 1)) "
+            "v |= ~0ULL << bits;\n"
+            "    return (T)v;\n"
+            "}\n"
+            "\n"
+            "// The shortest of two precisions which reads back the same.\n"
+            "static inline void dump_gen_float(float v) {\n"
+            "    char buf[32];\n"
+            "    snprintf(buf, sizeof(buf), \"%%.6g\", v);\n"
+            "    if (strtof(buf, 0) != v) {\n"
+            "        snprintf(buf, sizeof(buf), \"%%.9g\", v);\n"
+            "    }\n"
+            "    dump_printf(\"%%s\", buf);\n"
+            "}\n"
+            "\n"
+            "static inline void dump_gen_double(double v) {\n"
+            "    char buf[32];\n"
+            "    snprintf(buf, sizeof(buf), \"%%.15g\", v);\n"
+            "    if (strtod(buf, 0) != v) {\n"
+            "        snprintf(buf, sizeof(buf), \"%%.17g\", v);\n"
+            "    }\n"
+            "    dump_printf(\"%%s\", buf);\n"
+            "}\n"
+            "\n"
+            "static inline void dump_gen_char(unsigned char c) {\n"
+            "    if (isprint(c)) dump_printf(\"'%%c' (%%02x)\", c, c);\n"
+            "    else dump_printf(\"'\\\\x%%02x' (%%02x)\", c, c);\n"
+            "}\n"
+            "\n");
+    fputs(CODEGEN_CHARS, fp);
+    string code = gen.run();
+    fwrite(code.data(), 1, code.size(), fp);
+    if (fclose(fp)) {
+        perror(file_name);
+        return 1;
+    }
+    return 0;
 }
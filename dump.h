@@ -3,6 +3,7 @@
 
 #define DUMP_TEMPVAL_NAME dump_vp_
 #define DUMP_RECURSIVE_LEVEL 2
+#define DUMP_CACHELINE_SIZE 64
 
 #ifdef __cplusplus
 extern "C" {
@@ -14,6 +15,221 @@ extern "C" {
 
     void dump_s(void* p, const char* name, const char* file, int line);
 
+    /*
+     * Dumps only the given members, e.g. "stats.bytes_in,peer->addr,q[3].id".
+     * Paths are compiled to offsets once per (type, paths).
+     */
+    void dump_path(void* p, const char* type, const char* paths);
+
+    /*
+     * Finds live objects of a polymorphic class by scanning the heap and
+     * other anonymous memory for its vtable address.  Objects on the
+     * calling thread's stack are not found, and globals may be missed.
+     * Dumps up to `max_dump' of them and returns how many were found, or
+     * -1.
+     */
+    long dump_instances(const char* type, int max_dump);
+
+    /* Prints member offsets, holes and cache lines of a struct. */
+    void dump_layout(const char* type);
+    /* Prints wasted bytes of all loaded structs, worst `top' first. */
+    void dump_layout_summary(int top);
+
+    /*
+     * Write-protects the pages of a struct and records every write to it.
+     * Other data sharing those pages is slowed down, and objects on the
+     * stack must not be watched.  x86-64 Linux only.
+     */
+    int dump_watch(void* p, const char* type);
+    void dump_unwatch(void* p);
+    /* Prints recorded writes: member, writer function, old and new value. */
+    void dump_watch_report(void);
+
+    /*
+     * Prints a backtrace with the parameters and local variables of each
+     * frame.  Frames are found by frame pointers, so build with
+     * -fno-omit-frame-pointer or without optimization.  Up to 64 frames
+     * if max_frames is not positive.
+     */
+    void dump_locals(int max_frames);
+
+    /*
+     * Writes what dump_open read into a file which dump_index embeds in
+     * the binary as the .dumper_index section.  dump_open then loads that
+     * instead of DWARF, which also works for stripped binaries.
+     */
+    int dump_write_index(const char* file_name);
+
+    /*
+     * Writes a C++ header with a dump function for each of the structs
+     * `types' and the structs they hold, with offsets and labels fixed.
+     * See dump_gen.cc.
+     */
+    int dump_write_code(const char* file_name, const char* const* types,
+                        int n);
+
+    /*
+     * Strings are cut with "..." after `bytes' bytes (50 by default).
+     * Returns the previous limit; a non-positive value only queries it.
+     */
+    int dump_set_string_limit(int bytes);
+
+    /*
+     * Same output as dump(), but members of the struct are formatted by
+     * up to `threads' threads (all cores if not positive).
+     */
+    void dump_parallel(void* p, const char* type, int threads);
+
+    /*
+     * With aggregation on, p() and pv() fold primitive fields of the
+     * value into per-site statistics (count, min, max, mean and a log2
+     * histogram, or frequencies for enums) instead of printing it.  A
+     * report is printed every interval_sec seconds if it is positive, and
+     * by dump_aggregate_report.
+     */
+    void dump_aggregate(int enable, double interval_sec);
+    void dump_aggregate_report(void);
+
+    /*
+     * Log mode: p() and pv() copy the bytes of the value, and of what its
+     * pointers point to up to `pointee_budget' bytes, into a memory
+     * mapped file of about `bytes' bytes instead of printing it.  What
+     * p() points to is always copied.  Records which don't fit are
+     * counted and dropped.  dump_log_decode prints a log of `binary' to
+     * stdout as p() would have.  See dump_log.cc.
+     */
+    int dump_log_open(const char* path, unsigned long long bytes,
+                      int pointee_budget);
+    void dump_log_close(void);
+    int dump_log_decode(const char* binary, const char* log_path);
+
+    /*
+     * Crash mode: roots registered here are dumped to `fd' from a fatal
+     * signal handler without malloc or stdio.  Their dump plans are built
+     * at registration, so register after dump_open.  Install this before
+     * dump_watch so that watch mode passes other faults on to it.
+     */
+    int dump_crash_register(void* p, const char* type, const char* label);
+    int dump_crash_install(int fd);
+
+    /*
+     * Prints a struct, class, union or typedef named `type' with `fn'
+     * instead of its members.  Must be called before dump_open, e.g.
+     * from static initializers, and fails after it.  Formatters print
+     * with dump_printf.
+     */
+    typedef void (*dump_formatter_fn)(const void* p, void* arg);
+    int dump_register_formatter(const char* type, dump_formatter_fn fn,
+                                void* arg);
+    int dump_printf(const char* fmt, ...)
+        __attribute__((format(printf, 1, 2)));
+    /*
+     * Calls the formatter of `type' on `p' and returns 1, or returns 0 if
+     * there is none.  For code written by dump_write_code.
+     */
+    int dump_format(const void* p, const char* type);
+
+    /*
+     * Snapshot mode: forks, and the child dumps the roots as dump_unit
+     * does to `fd' from its copy-on-write image of memory, then exits.
+     * The caller is only paused for the fork.  dump_snapshot_wait reaps
+     * the child, fills dump_sec and returns the child's exit status.
+     */
+    typedef struct dump_root_t_ {
+        void* p;
+        const char* type;
+        /* The type name if NULL. */
+        const char* label;
+    } dump_root_t;
+    typedef struct dump_snapshot_t_ {
+        int pid;
+        /* How long the caller was paused by fork(2). */
+        double fork_sec;
+        /* How long the child took to dump. */
+        double dump_sec;
+        int status_fd;
+    } dump_snapshot_t;
+    int dump_snapshot(const dump_root_t* roots, int n, int fd,
+                      dump_snapshot_t* snap);
+    int dump_snapshot_wait(dump_snapshot_t* snap);
+
+    /*
+     * Starts a low-priority thread which answers queries on a Unix
+     * socket, one per line: "dump <global>", "path <global> <paths>" (as
+     * dump_path), "types <glob>" and "layout <type>".  Answers are cut
+     * at 1MB or 100ms and end with a "." line.  Objects are copied with
+     * bounded reads before they are printed, so freed or unmapped memory
+     * shows as an invalid pointer.
+     */
+    int dump_serve(const char* socket_path);
+    void dump_serve_stop(void);
+
+    /*
+     * Returns a handle of a type for dump_unit, or NULL if it isn't
+     * loaded.  `name' can be a mangled name from typeid.
+     */
+    void* dump_type_handle(const char* name);
+    /* Dumps `p' as the type of `handle' without any lookup. */
+    void dump_unit(void* p, void* handle, const char* label);
+
+    enum dump_unit_kind {
+        DUMP_KIND_PRIM,
+        DUMP_KIND_STRUCT,
+        DUMP_KIND_PTR,
+        DUMP_KIND_CV,
+        DUMP_KIND_TYPEDEF,
+        DUMP_KIND_FUNC,
+        DUMP_KIND_ARRAY,
+        DUMP_KIND_ENUM,
+        DUMP_KIND_NUM
+    };
+
+    typedef struct dump_stats_t_ {
+        /* Filled by dump_open. */
+        unsigned long long cus;
+        unsigned long long dies;
+        double open_sec;
+        double dwarf_init_sec;
+        double dwarf_walk_sec;
+        unsigned long long units[DUMP_KIND_NUM];
+        unsigned long long units_merged;
+        unsigned long long registry_bytes;
+        /* Summed over all threads which have dumped something. */
+        unsigned long long dump_calls;
+        unsigned long long dump_s_calls;
+        unsigned long long lookup_misses;
+        unsigned long long unreadable_ptrs;
+        unsigned long long bytes_emitted;
+        /* See dump_set_memory_budget. */
+        unsigned long long memory_budget;
+        unsigned long long resident_bytes;
+        unsigned long long groups;
+        unsigned long long registry_hits;
+        unsigned long long registry_loads;
+        unsigned long long registry_evictions;
+        /* Skeleton CUs of split DWARF, and how many of them are read. */
+        unsigned long long split_units;
+        unsigned long long split_loaded;
+    } dump_stats_t;
+
+    /* Safe to call from any thread at any time after dump_open. */
+    void dump_stats(dump_stats_t* st);
+
+    /*
+     * Caps the memory used by loaded types.  Must be called before
+     * dump_open.  Types are kept in one group per CU; groups are evicted
+     * least recently used first and read again from DWARF when needed.
+     * Identical types of different CUs are not merged in this mode.
+     * As any lookup may read or evict units, calls from different threads
+     * take turns on a lock instead of running in parallel.
+     */
+    int dump_set_memory_budget(unsigned long long bytes);
+
+    typedef void (*dump_site_func)(const char* file, int line,
+                                   unsigned long long calls, void* arg);
+    /* Calls `fn' once for each dump_s call site seen so far. */
+    void dump_stats_sites(dump_site_func fn, void* arg);
+
 #ifdef NDEBUG
 # define p(v)
 #else
@@ -32,6 +248,49 @@ extern "C" {
 
 #ifdef __cplusplus
 }
+
+#include <atomic>
+#include <typeinfo>
+
+namespace dumper {
+
+    /* The handle of T, looked up once after dump_open. */
+    template <class T>
+    struct TypeHandle {
+        static void* get() {
+            static std::atomic<void*> handle(nullptr);
+            void* h = handle.load(std::memory_order_acquire);
+            if (!h) {
+                h = dump_type_handle(typeid(T).name());
+                if (h) handle.store(h, std::memory_order_release);
+            }
+            return h;
+        }
+    };
+
+    /* Specialize this to print a type your own way. */
+    template <class T>
+    struct Printer {
+        static void print(const T& v, const char* label) {
+            dump_unit((void*)&v, TypeHandle<T>::get(), label);
+        }
+    };
+
+    template <class T>
+    struct Printer<T*> {
+        static void print(T* const& v, const char* label) {
+            dump_unit((void*)v, TypeHandle<T>::get(), label);
+        }
+    };
+
+    /* Unlike p(), works for any expression including rvalues. */
+    template <class T>
+    inline void print(const T& v, const char* label = nullptr) {
+        Printer<T>::print(v, label);
+    }
+
+}
+
 #endif
 
 #endif // ! dump_h_
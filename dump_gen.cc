@@ -0,0 +1,23 @@
+// Writes C++ functions which dump the given structs of a binary without
+// looking anything up at run time.
+//
+// usage: dump_gen <binary> <output header> <type>...
+//
+// For each struct T and the structs it holds, the header has
+// dump_gen_T(const void* p, const char* label), which prints what dump()
+// would, and DUMP_GEN_SIZE_T to check against sizeof(T).  Pointers are
+// printed but not followed.  Regenerate it when the types change.
+
+#include <stdio.h>
+
+#include "dump.h"
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s <binary> <output header> <type>...\n",
+                argv[0]);
+        return 1;
+    }
+    if (dump_open(argv[1], 0)) return 1;
+    return dump_write_code(argv[2], argv + 3, argc - 3);
+}
@@ -0,0 +1,20 @@
+// Writes the type index of a binary for the `index' target.
+//
+// usage: dump_index <binary> <index file>
+//
+// The Makefile then embeds the file as the .dumper_index section with
+// objcopy, and dump_open reads it instead of DWARF.
+
+#include <stdio.h>
+
+#include "dump.h"
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <binary> <index file>\n", argv[0]);
+        return 1;
+    }
+    // Addresses are kept unrelocated, as dump_open adds its base address.
+    if (dump_open(argv[1], 0)) return 1;
+    return dump_write_index(argv[2]);
+}
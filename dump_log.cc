@@ -0,0 +1,19 @@
+// Prints a log which a binary wrote after dump_log_open, with the types
+// from the binary's debug info.
+//
+// usage: dump_log <binary> <log>
+//
+// The binary must be the one which wrote the log.  Records are printed in
+// order of time, each after its time and call site.
+
+#include <stdio.h>
+
+#include "dump.h"
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <binary> <log>\n", argv[0]);
+        return 1;
+    }
+    return dump_log_decode(argv[1], argv[2]);
+}
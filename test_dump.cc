@@ -1,9 +1,12 @@
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <string>
 #include <vector>
 #include <map>
+#include <new>
 
 #include "dump.h"
 
@@ -57,6 +60,94 @@ public:
     const TestCpp& self;
 };
 
+class TestVirtual {
+public:
+    TestVirtual() : v(7) {}
+    virtual ~TestVirtual() {}
+    int v;
+};
+
+class TestDerived : public TestVirtual {
+public:
+    TestDerived() : w(8) {}
+    int w;
+};
+
+// Shares TestVirtual with any other virtual subclass.
+class TestVirtualBase : public virtual TestVirtual {
+public:
+    TestVirtualBase() : x(9) {}
+    int x;
+};
+
+struct TestBits {
+    unsigned ready : 1;
+    int delta : 5;
+    TestDump::TestEnum kind : 2;
+};
+
+// Printed by format_fixed as 12.34 instead of { raw = 1234 }.
+struct TestFixed {
+    int raw;
+};
+
+static void format_fixed(const void* p, void*) {
+    int raw = ((const TestFixed*)p)->raw;
+    dump_printf("%d.%02d", raw / 100, abs(raw % 100));
+}
+static int fixed_registered =
+    dump_register_formatter("TestFixed", format_fixed, NULL);
+
+#ifdef DUMP_GEN_CHECK
+// Built by `make gen` with what dump_gen wrote for test_dump.
+#include "test_dump_gen.h"
+
+static_assert(DUMP_GEN_SIZE_TestDump_ == sizeof(TestDump), "TestDump");
+static_assert(DUMP_GEN_SIZE_TestUnion == sizeof(TestDump::TestUnion),
+              "TestUnion");
+static_assert(DUMP_GEN_SIZE_TestCpp == sizeof(TestCpp), "TestCpp");
+static_assert(DUMP_GEN_SIZE_TestCppBase == sizeof(TestCppBase),
+              "TestCppBase");
+static_assert(DUMP_GEN_SIZE_TestFixed == sizeof(TestFixed), "TestFixed");
+
+// Prints the same TestDump and TestFixed with dump_gen's code if `mode'
+// is "gen" and with dump_unit otherwise.  Pointers are null as only
+// dump_unit follows them.
+static int check_gen(const char* mode) {
+    TestDump d;
+    memset(&d, 0, sizeof(d));
+    d.s = -2;
+    d.i = 3;
+    d.l = 4;
+    d.st = 5;
+    d.ll = 0xfffffffffffll;
+    d.c = 'c';
+    d.array[0] = 1;
+    d.en = TestDump::ENUM2;
+    strcpy(d.un.b, "a\nb");
+    TestFixed price;
+    price.raw = 1234;
+
+    if (!strcmp(mode, "gen")) {
+        dump_gen_TestDump_(&d, "d");
+        dump_gen_TestFixed(&price, "price");
+        return 0;
+    }
+    void* h = dump_type_handle("TestDump_");
+    void* fh = dump_type_handle("TestFixed");
+    if (!h || !fh) return 1;
+    dump_unit(&d, h, "d");
+    dump_unit(&price, fh, "price");
+    return 0;
+}
+#endif
+
+static void test_locals(TestDump* dp, int depth) {
+    int sum = dp->i + depth;
+    (void)sum;
+    dump_locals(2);
+}
+
 int main(int argc, char* argv[]) {
     TestDump d;
     d.s = 2;
@@ -82,6 +173,10 @@ int main(int argc, char* argv[]) {
 
     dump_open(argv[0], base_addr);
 
+#ifdef DUMP_GEN_CHECK
+    return check_gen(argc > 1 ? argv[1] : "gen");
+#endif
+
     p(argc);
 //    pv(argc);
 
@@ -89,11 +184,109 @@ int main(int argc, char* argv[]) {
 //    pv(d);
 //    dump(&d, "TestDump");
 
+    // "hoge-" is cut to "hog...".
+    int limit = dump_set_string_limit(3);
+    p(d.str);
+    dump_set_string_limit(limit);
+
+    double dbl = 0.1;
+    p(dbl);
+    bool flag = false;
+    p(flag);
+
+    TestFixed price;
+    price.raw = 1234;
+    p(price);
+
     TestCpp cpp;
     p(cpp);
+
+    dumper::print(d, "d");
+    dumper::print(cpp.cppstr.size(), "cpp.cppstr.size()");
+    dumper::print(&cpp, "&cpp");
 //    pv(cpp);
 //    dump(&cpp, "TestCpp");
 
+    dump_parallel(&d, "TestDump", 4);
+
+    // Written straight to fd 1 by a forked child.
+    dump_root_t roots[] = {
+        { &d, "TestDump", "d" },
+        { &cpp, "TestCpp", NULL },
+    };
+    dump_snapshot_t snap;
+    fflush(stdout);
+    if (!dump_snapshot(roots, 2, 1, &snap)) {
+        dump_snapshot_wait(&snap);
+        printf("snapshot: fork %.3f ms\n", snap.fork_sec * 1e3);
+    }
+
+    dump_path(&d, "TestDump", "i, dump->dump->c, array[0], strp[0], un.b");
+
+    TestVirtual* tv = new TestVirtual();
+    dump_instances("TestVirtual", 10);
+    delete tv;
+
+    // Dumped as TestDerived.
+    tv = new TestDerived();
+    p(tv);
+    delete tv;
+
+    TestVirtualBase vb;
+    p(vb);
+    TestBits bits = { 1, -3, TestDump::ENUM2 };
+    p(bits);
+
+    test_locals(&d, 1);
+
+    dump_aggregate(1, 0);
+    for (int i = 0; i < 100; i++) {
+        d.i = i;
+        d.en = i % 3 ? TestDump::ENUM1 : TestDump::ENUM2;
+        p(d);
+    }
+    dump_aggregate(0, 0);
+    dump_aggregate_report();
+
+    // Printed by `make log`.
+    if (!dump_log_open("test_dump.log", 1 << 20, 256)) {
+        for (int i = 0; i < 3; i++) {
+            d.i = i;
+            p(d);
+        }
+        dump_log_close();
+    }
+
+    dump_layout("TestDump");
+    dump_layout_summary(5);
+
+    // Dumped to stderr if the rest of this test crashes.
+    dump_crash_register(&d, "TestDump", "d");
+    // `make crash' crashes here on purpose to check escapes.
+    TestDump cd = d;
+    cd.c = '\n';
+    cd.str = "crash\n";
+    dump_crash_register(&cd, "TestDump", "cd");
+    dump_crash_install(2);
+    if (argc > 1 && !strcmp(argv[1], "crash")) raise(SIGSEGV);
+
+    // Give the watched object its own page.
+    void* page;
+    if (!posix_memalign(&page, 4096, 4096)) {
+        TestDump* wd = new (page) TestDump();
+        if (!dump_watch(wd, "TestDump")) {
+            wd->i = 42;
+            wd->en = TestDump::ENUM2;
+            dump_unwatch(wd);
+            dump_watch_report();
+        }
+        free(page);
+    }
+
+    dump_stats_t st;
+    dump_stats(&st);
+    p(st);
+
 /*
     void* vp;
     vp = &vp;
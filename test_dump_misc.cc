@@ -39,8 +39,6 @@ int main(int argc, char* argv[]) {
     FILE* fp = fopen("test_dump.cc", "r");
     p(fp);
 
-/* bit field is unimplemented
-    bitfields bf = { 1, 0, 2, 2 };
+    bitfields bf = { -1, 0, -1, 1 };
     p(bf);
-*/
 }